@@ -78,6 +78,19 @@ struct priv_srv {
 	char *name;
 };
 
+#if defined(USE_UNBOUND) || defined(USE_ARES)
+/* A single DNS lookup issued on behalf of a query, tracked so that it can be
+ * cancelled when the query is finished or destroyed.
+ */
+struct priv_lookup {
+	struct priv_srv *srv;
+#if defined(USE_UNBOUND)
+	int async_id;
+#endif
+	struct priv_lookup *previous, *next;
+};
+#endif
+
 struct priv_dns {
 	netresolve_query_t query;
 	int protocol;
@@ -95,36 +108,100 @@ struct priv_dns {
 	bool answered;
 	bool failed;
 	bool secure;
+#if defined(USE_UNBOUND) || defined(USE_ARES)
+	struct priv_instance *instance;
+	struct priv_lookup lookups;
+	struct priv_dns *previous, *next;
+#elif defined(USE_AVAHI)
+	struct AvahiClient *client;
+	struct AvahiHostNameResolver *resolver;
+	struct AvahiPoll poll_config;
+	AvahiLookupFlags flags;
+#endif
+};
+
+#if defined(USE_UNBOUND) || defined(USE_ARES)
+/* The resolver handle is shared by all queries run by the backend instance
+ * so that the configuration is only read once and the resolver cache is
+ * retained between queries. Its file descriptors are watched on behalf of
+ * one of the active queries, the owner.
+ */
+struct priv_instance {
+	bool trust;
 #if defined(USE_UNBOUND)
-	struct ub_ctx* ctx;
 	bool validate;
+	const char *server;
+	struct ub_ctx* ctx;
 	netresolve_watch_t watch;
 #elif defined(USE_ARES)
+	bool initialized;
 	ares_channel channel;
 	fd_set rfds, wfds;
 	int nfds;
 	netresolve_watch_t *watches;
-#elif defined(USE_AVAHI)
-	struct AvahiClient *client;
-	struct AvahiHostNameResolver *resolver;
-	struct AvahiPoll poll_config;
-	AvahiLookupFlags flags;
 #endif
+	struct priv_dns queries;
+	struct priv_dns *owner;
 };
 
+static void watch_instance(struct priv_instance *instance);
+static void unwatch_instance(struct priv_instance *instance);
+
+static struct priv_srv *
+finish_lookup(struct priv_lookup *lookup)
+{
+	struct priv_srv *srv = lookup->srv;
+
+	if (srv) {
+		lookup->previous->next = lookup->next;
+		lookup->next->previous = lookup->previous;
+		srv->priv->pending--;
+	}
+
+	free(lookup);
+
+	return srv;
+}
+#endif
+
 static void
 lookup_dns(struct priv_srv *srv, const char *name, int type, int class)
 {
 	struct priv_dns *priv = srv->priv;
 
+#if defined(USE_UNBOUND) || defined(USE_ARES)
+	struct priv_lookup *lookup;
+#endif
+#if defined(USE_UNBOUND)
+	int status;
+#endif
+
 	debug("Looking up %s record for %s", ldns_rr_descript(type)->_name, name);
 
+#if defined(USE_UNBOUND) || defined(USE_ARES)
+	if (!(lookup = calloc(1, sizeof *lookup))) {
+		error("Memory allocation failed.");
+		priv->failed = true;
+		return;
+	}
+
+	lookup->srv = srv;
+	lookup->previous = priv->lookups.previous;
+	lookup->next = &priv->lookups;
+	lookup->previous->next = lookup->next->previous = lookup;
+#endif
+
 	priv->pending++;
 
 #if defined(USE_UNBOUND)
-	ub_resolve_async(priv->ctx, name, type, class, srv, ubdns_callback, NULL);
+	status = ub_resolve_async(priv->instance->ctx, name, type, class, lookup, ubdns_callback, &lookup->async_id);
+	if (status) {
+		error("libunbound: %s", ub_strerror(status));
+		finish_lookup(lookup);
+		priv->failed = true;
+	}
 #elif defined(USE_ARES)
-	ares_query(priv->channel, name, class, type, aresdns_callback, srv);
+	ares_query(priv->instance->channel, name, class, type, aresdns_callback, lookup);
 #elif defined(USE_AVAHI)
 	if (!avahi_record_browser_new(
 			priv->client,
@@ -365,7 +442,7 @@ apply_answer(struct priv_srv *srv, const uint8_t *data, size_t length)
 	ldns_rr_list *answer = ldns_pkt_answer(pkt);
 
 #if defined(USE_UNBOUND)
-	if (!priv->validate)
+	if (!priv->instance->validate)
 #endif
 	if (!ldns_pkt_ad(pkt))
 		priv->secure = false;
@@ -436,14 +513,13 @@ static void apply_answer(struct priv_srv *srv, const uint8_t *answer, size_t len
 static void
 ubdns_callback(void *arg, int status, struct ub_result* result)
 {
-	struct priv_srv *srv = arg;
+	struct priv_srv *srv = finish_lookup(arg);
 	struct priv_dns *priv = srv->priv;
 
-	priv->pending--;
-
 	if (status) {
 		error("libunbound: %s", ub_strerror(status));
 		priv->failed = true;
+		check(priv);
 		return;
 	}
 
@@ -466,9 +542,25 @@ ubdns_callback(void *arg, int status, struct ub_result* result)
 static void
 dispatch(netresolve_query_t query, netresolve_watch_t watch, int fd, int events, void *data)
 {
-	struct priv_dns *priv = netresolve_backend_get_priv(query);
+	struct priv_instance *instance = netresolve_backend_get_instance(query);
+
+	ub_process(instance->ctx);
+}
+
+static void
+watch_instance(struct priv_instance *instance)
+{
+	assert(!instance->watch);
+
+	instance->watch = netresolve_watch_add(instance->owner->query, ub_fd(instance->ctx), POLLIN, dispatch, NULL);
+}
 
-	ub_process(priv->ctx);
+static void
+unwatch_instance(struct priv_instance *instance)
+{
+	if (instance->watch)
+		netresolve_watch_remove(instance->owner->query, instance->watch, false);
+	instance->watch = NULL;
 }
 
 #elif defined(USE_ARES)
@@ -476,47 +568,57 @@ dispatch(netresolve_query_t query, netresolve_watch_t watch, int fd, int events,
 static void dispatch(netresolve_query_t query, netresolve_watch_t watch, int fd, int events, void *data);
 
 static void
-watch_file_descriptors(struct priv_dns *priv)
+watch_instance(struct priv_instance *instance)
 {
-	assert(priv->nfds == 0);
+	assert(instance->nfds == 0);
 
-	priv->nfds = ares_fds(priv->channel, &priv->rfds, &priv->wfds);
-	priv->watches = realloc(priv->watches, priv->nfds * sizeof *priv->watches);
+	FD_ZERO(&instance->rfds);
+	FD_ZERO(&instance->wfds);
+	instance->nfds = ares_fds(instance->channel, &instance->rfds, &instance->wfds);
+	instance->watches = realloc(instance->watches, instance->nfds * sizeof *instance->watches);
 
-	for (int fd = 0; fd < priv->nfds; fd++) {
-		if (FD_ISSET(fd, &priv->rfds))
-			priv->watches[fd] = netresolve_watch_add(priv->query, fd, POLLIN, dispatch, NULL);
-		if (FD_ISSET(fd, &priv->wfds))
-			priv->watches[fd] = netresolve_watch_add(priv->query, fd, POLLOUT, dispatch, NULL);
+	for (int fd = 0; fd < instance->nfds; fd++) {
+		int events = 0;
+
+		if (FD_ISSET(fd, &instance->rfds))
+			events |= POLLIN;
+		if (FD_ISSET(fd, &instance->wfds))
+			events |= POLLOUT;
+
+		instance->watches[fd] = events ? netresolve_watch_add(instance->owner->query, fd, events, dispatch, NULL) : NULL;
 	}
 }
 
 static void
-unwatch_file_descriptors(struct priv_dns *priv)
+unwatch_instance(struct priv_instance *instance)
 {
-	assert(priv->nfds != 0);
+	for (int fd = 0; fd < instance->nfds; fd++)
+		if (instance->watches[fd])
+			netresolve_watch_remove(instance->owner->query, instance->watches[fd], false);
 
-	for (int fd = 0; fd < priv->nfds; fd++)
-		if (FD_ISSET(fd, &priv->rfds))
-			netresolve_watch_remove(priv->query, priv->watches[fd], false);
+	FD_ZERO(&instance->rfds);
+	FD_ZERO(&instance->wfds);
+	instance->nfds = 0;
+}
 
-	FD_ZERO(&priv->rfds);
-	FD_ZERO(&priv->wfds);
-	priv->nfds = 0;
+/* The set of file descriptors changes with new lookups. */
+static void
+rewatch_instance(struct priv_instance *instance)
+{
+	unwatch_instance(instance);
+	watch_instance(instance);
 }
 
 static void
 dispatch(netresolve_query_t query, netresolve_watch_t watch, int fd, int events, void *data)
 {
-	struct priv_dns *priv = netresolve_backend_get_priv(query);
+	struct priv_instance *instance = netresolve_backend_get_instance(query);
 
-	unwatch_file_descriptors(priv);
-	ares_process_fd(priv->channel,
+	unwatch_instance(instance);
+	ares_process_fd(instance->channel,
 			events & POLLIN ? fd : ARES_SOCKET_BAD,
 			events & POLLOUT ? fd : ARES_SOCKET_BAD);
-	watch_file_descriptors(priv);
-
-	check(priv);
+	watch_instance(instance);
 }
 
 static void apply_answer(struct priv_srv *srv, const uint8_t *answer, size_t length);
@@ -524,10 +626,14 @@ static void apply_answer(struct priv_srv *srv, const uint8_t *answer, size_t len
 static void
 aresdns_callback(void *arg, int status, int timeouts, unsigned char *abuf, int alen)
 {
-	struct priv_srv *srv = arg;
-	struct priv_dns *priv = srv->priv;
+	struct priv_srv *srv = finish_lookup(arg);
+	struct priv_dns *priv;
 
-	priv->pending--;
+	/* The query has been finished or destroyed in the meantime. */
+	if (!srv)
+		return;
+
+	priv = srv->priv;
 
 	switch (status) {
 	case ARES_EDESTRUCTION:
@@ -535,15 +641,14 @@ aresdns_callback(void *arg, int status, int timeouts, unsigned char *abuf, int a
 		return;
 	case ARES_SUCCESS:
 	case ARES_ENOTFOUND:
+		apply_answer(srv, abuf, alen);
 		break;
 	default:
 		error("ares: %s", ares_strerror(status));
 		priv->failed = true;
-		return;
+		break;
 	}
 
-	apply_answer(srv, abuf, alen);
-
 	check(priv);
 }
 
@@ -769,11 +874,164 @@ address_callback (
 
 #endif
 
+#if defined(USE_UNBOUND) || defined(USE_ARES)
+
+static void
+attach(struct priv_dns *priv)
+{
+	struct priv_instance *instance = priv->instance;
+
+	priv->previous = instance->queries.previous;
+	priv->next = &instance->queries;
+	priv->previous->next = priv->next->previous = priv;
+
+	if (!instance->owner) {
+		instance->owner = priv;
+		watch_instance(instance);
+	}
+}
+
+static void
+detach(struct priv_dns *priv)
+{
+	struct priv_instance *instance = priv->instance;
+
+	if (!priv->next)
+		return;
+
+	priv->previous->next = priv->next;
+	priv->next->previous = priv->previous;
+	priv->previous = priv->next = NULL;
+
+	/* Hand over the file descriptors to another active query. */
+	if (instance->owner == priv) {
+		unwatch_instance(instance);
+		instance->owner = NULL;
+		if (instance->queries.next != &instance->queries) {
+			instance->owner = instance->queries.next;
+			watch_instance(instance);
+		}
+	}
+}
+
+static void
+cleanup_instance(void *data)
+{
+	struct priv_instance *instance = data;
+
+	assert(!instance->owner);
+
+#if defined(USE_UNBOUND)
+	if (instance->ctx)
+		ub_ctx_delete(instance->ctx);
+#elif defined(USE_ARES)
+	/* Lookups left behind by finished queries are freed by the callback. */
+	if (instance->channel)
+		ares_destroy(instance->channel);
+	if (instance->initialized)
+		ares_library_cleanup();
+	free(instance->watches);
+#endif
+}
+
+static struct priv_instance *
+get_instance(netresolve_query_t query, char **settings)
+{
+	struct priv_instance *instance = netresolve_backend_get_instance(query);
+	int status;
+
+	if (!instance) {
+		if (!(instance = netresolve_backend_new_instance(query, sizeof *instance, cleanup_instance)))
+			return NULL;
+
+		instance->queries.previous = instance->queries.next = &instance->queries;
+
+		for (; *settings; settings++) {
+			if (!strcmp(*settings, "trust"))
+				instance->trust = true;
+#if defined(USE_UNBOUND)
+			else if (!strcmp(*settings, "validate"))
+				instance->validate = instance->trust = true;
+			else if (!strncmp(*settings, "server=", 7))
+				instance->server = *settings + 7;
+#endif
+		}
+	}
+
+	/* Retry with the next query when the initialization fails. */
+#if defined(USE_UNBOUND)
+	if (!instance->ctx) {
+		if (!(instance->ctx = ub_ctx_create()))
+			return NULL;
+
+		if (instance->server)
+			status = ub_ctx_set_fwd(instance->ctx, instance->server);
+		else
+			status = ub_ctx_resolvconf(instance->ctx, NULL);
+		if (!status && instance->validate)
+			status = ub_ctx_add_ta_file(instance->ctx, "/etc/dnssec/root-anchors.txt");
+		if (status) {
+			error("libunbound: %s", ub_strerror(status));
+			ub_ctx_delete(instance->ctx);
+			instance->ctx = NULL;
+			return NULL;
+		}
+	}
+#elif defined(USE_ARES)
+	if (!instance->initialized) {
+		status = ares_library_init(ARES_LIB_INIT_ALL);
+		if (status != ARES_SUCCESS) {
+			error("ares library: %s", ares_strerror(status));
+			return NULL;
+		}
+		instance->initialized = true;
+	}
+	if (!instance->channel) {
+		/* ares doesn't seem to accept const options */
+		static struct ares_options options = {
+			.flags = ARES_FLAG_NOSEARCH | ARES_FLAG_NOALIASES,
+			.lookups = "b"
+		};
+
+		status = ares_init_options(&instance->channel, &options,
+				ARES_OPT_FLAGS | ARES_OPT_LOOKUPS);
+		if (status != ARES_SUCCESS) {
+			error("ares channel: %s", ares_strerror(status));
+			instance->channel = NULL;
+			return NULL;
+		}
+	}
+#endif
+
+	return instance;
+}
+
+#endif
+
 static void
 cleanup(void *data)
 {
 	struct priv_dns *priv = data;
 
+#if defined(USE_UNBOUND) || defined(USE_ARES)
+	/* Cancel lookups still in progress. */
+	while (priv->lookups.next != &priv->lookups) {
+		struct priv_lookup *lookup = priv->lookups.next;
+
+		lookup->previous->next = lookup->next;
+		lookup->next->previous = lookup->previous;
+
+#if defined(USE_UNBOUND)
+		ub_cancel(priv->instance->ctx, lookup->async_id);
+		free(lookup);
+#elif defined(USE_ARES)
+		/* The channel is shared, the lookup is freed by the callback. */
+		lookup->srv = NULL;
+		lookup->previous = lookup->next = NULL;
+#endif
+	}
+#endif
+
 	while (priv->srv.next != &priv->srv) {
 		struct priv_srv *srv = priv->srv.next;
 
@@ -783,17 +1041,11 @@ cleanup(void *data)
 		free(srv->name);
 		free(srv);
 	}
+	free(priv->srv.name);
 
-#if defined(USE_UNBOUND)
-	if (priv->watch)
-		netresolve_watch_remove(priv->query, priv->watch, false);
-	if (priv->ctx)
-		ub_ctx_delete(priv->ctx);
-#elif defined(USE_ARES)
-		if (priv->nfds)
-		unwatch_file_descriptors(priv);
-	free(priv->watches);
-	ares_destroy(priv->channel);
+#if defined(USE_UNBOUND) || defined(USE_ARES)
+	if (priv->instance)
+		detach(priv);
 #elif defined(USE_AVAHI)
 	if (priv->client)
 		avahi_client_free(priv->client);
@@ -804,76 +1056,37 @@ static struct priv_dns *
 setup(netresolve_query_t query, char **settings)
 {
 	struct priv_dns *priv = netresolve_backend_new_priv(query, sizeof *priv, cleanup);
+#if defined(USE_AVAHI)
 	int status;
-#if defined(USE_UNBOUND)
-	const char *server = NULL;
-#elif defined(USE_UNBOUND)
-
 #endif
 
 	if (!priv)
-		return NULL;;
+		return NULL;
 
 	priv->srv.priv = priv;
 	priv->srv.previous = priv->srv.next = &priv->srv;
 
-	for (; *settings; settings++) {
-		if (!strcmp(*settings, "trust"))
-			priv->secure = true;
-#if defined(USE_UNBOUND)
-		else if (!strcmp(*settings, "validate"))
-			priv->validate = priv->secure = true;
-		else if (!strncmp(*settings, "server=", 7))
-			server = *settings + 7;
-#endif
-	}
-
 	const char *name = netresolve_backend_get_nodename(query);
 	priv->srv.name = name ? strdup(name) : NULL;
 	priv->family = netresolve_backend_get_family(query);
 
 	priv->query = query;
 
-#if defined(USE_UNBOUND)
-	priv->ctx = ub_ctx_create();
-	if(!priv->ctx)
-		return NULL;;
+#if defined(USE_UNBOUND) || defined(USE_ARES)
+	priv->lookups.previous = priv->lookups.next = &priv->lookups;
 
-	if (server) {
-		if ((status = ub_ctx_set_fwd(priv->ctx, server)) != 0) {
-			error("libunbound: %s", ub_strerror(status));
-			return NULL;
-		}
-	} else {
-		if ((status = ub_ctx_resolvconf(priv->ctx, NULL)) != 0) {
-			error("libunbound: %s", ub_strerror(status));
-			return NULL;;
-		}
-	}
-	if (priv->validate && (status = ub_ctx_add_ta_file(priv->ctx, "/etc/dnssec/root-anchors.txt"))) {
-		error("libunbound: %s", ub_strerror(status));
-		return NULL;
-	}
-	priv->watch = netresolve_watch_add(query, ub_fd(priv->ctx), POLLIN, dispatch, NULL);
-#elif defined(USE_ARES)
-	/* ares doesn't seem to accept const options */
-	static struct ares_options options = {
-		.flags = ARES_FLAG_NOSEARCH | ARES_FLAG_NOALIASES,
-		.lookups = "b"
-	};
-
-	status = ares_library_init(ARES_LIB_INIT_ALL);
-	if (status != ARES_SUCCESS) {
-		error("ares library: %s", ares_strerror(status));
+	if (!(priv->instance = get_instance(query, settings)))
 		return NULL;
-	}
-	status = ares_init_options(&priv->channel, &options,
-			ARES_OPT_FLAGS | ARES_OPT_LOOKUPS);
-	if (status != ARES_SUCCESS) {
-		error("ares channel: %s", ares_strerror(status));
-		return NULL;
-	}
+
+	priv->secure = priv->instance->trust;
+
+	attach(priv);
 #elif defined(USE_AVAHI)
+	for (; *settings; settings++) {
+		if (!strcmp(*settings, "trust"))
+			priv->secure = true;
+	}
+
 	priv->poll_config.userdata = priv;
 	priv->poll_config.watch_new = watch_new;
 	priv->poll_config.watch_update = watch_update;
@@ -910,7 +1123,7 @@ query_forward(netresolve_query_t query, char **settings)
 		lookup_host(&priv->srv);
 
 #if defined(USE_ARES)
-	watch_file_descriptors(priv);
+	rewatch_instance(priv->instance);
 #endif
 }
 
@@ -946,7 +1159,7 @@ query_reverse(netresolve_query_t query, char **settings)
 	lookup_address(priv);
 
 #if defined(USE_ARES)
-	watch_file_descriptors(priv);
+	rewatch_instance(priv->instance);
 #endif
 }
 
@@ -964,6 +1177,6 @@ query_dns(netresolve_query_t query, char **settings)
 	lookup_dns(&priv->srv, priv->srv.name, priv->type, priv->cls);
 
 #if defined(USE_ARES)
-	watch_file_descriptors(priv);
+	rewatch_instance(priv->instance);
 #endif
 }
@@ -23,22 +23,33 @@
  */
 #include <netresolve-backend.h>
 #include <stdlib.h>
-#include <unistd.h>
-
-struct hosts_list {
-	struct hosts_item *items;
-	int count;
-	int reserved;
-};
+#include <ctype.h>
 
 struct hosts_item {
-	char *name;
+	const char *name;
 	int family;
 	union {
 		struct in_addr address4;
 		struct in6_addr address6;
 	} address;
 	int ifindex;
+	struct hosts_item *name_next;
+	struct hosts_item *address_next;
+};
+
+/* struct hosts_index:
+ *
+ * Parsed hosts file shared by all queries in the process. Items are hashed
+ * both by name and by address, each hash chain keeps the order of the file.
+ */
+struct hosts_index {
+	struct netresolve_file file;
+	struct hosts_item *items;
+	size_t count;
+	size_t reserved;
+	size_t mask;
+	struct hosts_item **names;
+	struct hosts_item **addresses;
 };
 
 static size_t
@@ -54,44 +65,111 @@ family_to_length(int family)
 	}
 }
 
-static void
-add_node(struct hosts_list *list, const char *name, int family, void *address, int ifindex)
+/* FNV-1a, names are compared case insensitively. */
+static size_t
+hash_name(const char *name)
 {
-	struct hosts_item item = {
-		.family = family,
-		.ifindex = ifindex,
-		.name = name ? strdup(name) : NULL
-	};
+	size_t hash = 2166136261u;
 
-	memcpy(&item.address, address, family_to_length(family));
+	for (; *name; name++)
+		hash = (hash ^ (unsigned char) tolower(*name)) * 16777619u;
 
-	if (list->count == list->reserved) {
-		if (!list->reserved)
-			list->reserved = 256;
-		else
-			list->reserved *= 2;
-		list->items = realloc(list->items, list->reserved * sizeof item);
+	return hash;
+}
+
+static size_t
+hash_address(int family, const void *address)
+{
+	const unsigned char *data = address;
+	size_t hash = 2166136261u ^ family;
+
+	for (int i = 0; i < family_to_length(family); i++)
+		hash = (hash ^ data[i]) * 16777619u;
+
+	return hash;
+}
+
+static void
+add_node(struct hosts_index *index, const char *name, int family, void *address, int ifindex)
+{
+	struct hosts_item *item;
+
+	if (index->count == index->reserved) {
+		index->reserved = index->reserved ? 2 * index->reserved : 256;
+		if (!(index->items = realloc(index->items, index->reserved * sizeof *index->items)))
+			abort();
 	}
 
-	debug("hosts: adding item %s family %d", item.name, item.family);
-	memcpy(&list->items[list->count++], &item, sizeof item);
+	item = &index->items[index->count++];
+	memset(item, 0, sizeof *item);
+	item->name = name;
+	item->family = family;
+	item->ifindex = ifindex;
+	memcpy(&item->address, address, family_to_length(family));
 }
 
 static void
-read_item(struct hosts_list *list, char *line)
+read_item(struct hosts_index *index, char *line)
 {
 	const char *name;
+	char *saveptr = NULL;
+	char *string = strtok_r(line, " \t", &saveptr);
 	Address address;
 	int family;
-	int ifindex;
+	int ifindex = 0;
 
-	if (!(netresolve_backend_parse_address(strtok(line, " \t"), &address, &family, &ifindex)))
+	/* Only resolve interface names when there are any. */
+	if (!string || !netresolve_backend_parse_address(string, &address, &family, strchr(string, '%') ? &ifindex : NULL))
 		return;
-	while ((name = strtok(NULL, " \t")))
-		add_node(list, name, family, &address, ifindex);
+	while ((name = strtok_r(NULL, " \t", &saveptr)))
+		add_node(index, name, family, &address, ifindex);
+}
+
+static void
+read_items(struct hosts_index *index)
+{
+	char *line = index->file.data;
+	char *end;
+
+	for (; *line; line = end) {
+		if ((end = strchr(line, '\n')))
+			*end++ = '\0';
+		else
+			end = line + strlen(line);
+		/* Comment */
+		line[strcspn(line, "#")] = '\0';
+		read_item(index, line);
+	}
 }
 
-#define BUFFER_SIZE 1024
+/* Chains are built backwards to keep the order of the file. */
+static bool
+build_hash(struct hosts_index *index)
+{
+	size_t size = 16;
+
+	while (size < index->count)
+		size *= 2;
+
+	index->mask = size - 1;
+	index->names = calloc(size, sizeof *index->names);
+	index->addresses = calloc(size, sizeof *index->addresses);
+	if (!index->names || !index->addresses)
+		return false;
+
+	for (size_t i = index->count; i--;) {
+		struct hosts_item *item = &index->items[i];
+		struct hosts_item **name_bucket = &index->names[hash_name(item->name) & index->mask];
+		struct hosts_item **address_bucket = &index->addresses[hash_address(item->family, &item->address) & index->mask];
+
+		item->name_next = *name_bucket;
+		*name_bucket = item;
+		item->address_next = *address_bucket;
+		*address_bucket = item;
+	}
+
+	return true;
+}
 
 static char *
 concat(const char *a, const char *b)
@@ -115,93 +193,85 @@ get_hosts_file(void)
 	return concat(etc, suffix);
 }
 
+static bool
+parse_index(struct netresolve_file *file)
+{
+	struct hosts_index *index = (void *) file;
+
+	if (file->data) {
+		read_items(index);
+		debug("hosts: indexed %zu items from '%s'", index->count, file->path);
+	} else
+		error("Cannot read hosts file '%s': %s", file->path, strerror(file->error));
+
+	return build_hash(index);
+}
+
 static void
-read_list(struct hosts_list *list)
+cleanup_index(struct netresolve_file *file)
 {
-	char *hosts_file = get_hosts_file();
-	int fd = open(hosts_file, O_RDONLY);
-	char buffer[BUFFER_SIZE];
-	char *current = buffer;
-	char *end = buffer + sizeof buffer;
-	char *new;
-	size_t size;
-
-
-	if (fd == -1) {
-		error("Cannot read hosts file '%s': %s", hosts_file, strerror(errno));
-		goto fail_open;
-	}
+	struct hosts_index *index = (void *) file;
 
+	free(index->items);
+	free(index->names);
+	free(index->addresses);
+}
 
-	while (true) {
-		if (current == end)
-			goto out;
+static struct netresolve_file_cache hosts_cache = {
+	.size = sizeof (struct hosts_index),
+	.parse = parse_index,
+	.cleanup = cleanup_index,
+};
 
-		size = read(fd, current, end-current);
+static struct hosts_index *
+get_index(void)
+{
+	char *path = get_hosts_file();
+	struct hosts_index *index;
 
-		if (size == 0)
-			goto out;
-		if (size == -1)
-			goto out;
+	if (!path)
+		return NULL;
 
-		current += size;
+	index = (void *) netresolve_file_get(&hosts_cache, path, NULL);
+	free(path);
 
-		/* buffer ...record... new ...next... current ...empty... end */
-		for (new = buffer; new < current; new++) {
-			/* Comment */
-			if (*new == '#')
-				*new = '\0';
-			/* New line */
-			if (*new == '\n') {
-				*new++ = '\0';
-				read_item(list, buffer);
-				memmove(buffer, new, current - new);
-				current = buffer + (current - new);
-				new = buffer - 1;
-			}
-		}
+	return index;
+}
 
-		read_item(list, buffer);
-	}
-out:
-	close(fd);
-fail_open:
-	free(hosts_file);
-	add_node(list, NULL, 0, NULL, 0);
-	list->reserved = list->count;
-	list->items = realloc(list->items, list->reserved * sizeof *list->items);
+__attribute__((destructor))
+static void
+free_current(void)
+{
+	netresolve_file_clear(&hosts_cache);
 }
 
 void
 query_forward(netresolve_query_t query, char **settings)
 {
 	const char *node = netresolve_backend_get_nodename(query);
-	struct hosts_list list = { 0 };
+	struct hosts_index *index;
 	struct hosts_item *item;
 	int count = 0;
 
-	if (!node) {
+	if (!node || !(index = get_index())) {
 		netresolve_backend_failed(query);
 		return;
 	}
 
-	/* TODO: Would be nice to read the hosts once in a thread-safe way and with timestamp checking. */
-	read_list(&list);
-
-	for (item = list.items; item->name; item++) {
-		if (strcmp(node, item->name))
+	for (item = index->names[hash_name(node) & index->mask]; item; item = item->name_next) {
+		if (strcasecmp(node, item->name))
 			continue;
 		netresolve_backend_add_path(query, item->family, &item->address, item->ifindex, 0, 0, 0, 0, 0, 0);
 		count++;
 	}
 
+	netresolve_file_put(&hosts_cache, &index->file);
+
 	if (count) {
 		netresolve_backend_set_secure(query);
 		netresolve_backend_finished(query);
 	} else
 		netresolve_backend_failed(query);
-
-	free(list.items);
 }
 
 void
@@ -209,14 +279,16 @@ query_reverse(netresolve_query_t query, char **settings)
 {
 	int family = netresolve_backend_get_family(query);
 	const void *address = netresolve_backend_get_address(query);
-	struct hosts_list list = { 0 };
+	struct hosts_index *index;
 	struct hosts_item *item;
 	int count = 0;
 
-	/* FIXME: we need to read the host once and in a thread-safe manner */
-	read_list(&list);
+	if (!address || !family_to_length(family) || !(index = get_index())) {
+		netresolve_backend_failed(query);
+		return;
+	}
 
-	for (item = list.items; item->name; item++) {
+	for (item = index->addresses[hash_address(family, address) & index->mask]; item; item = item->address_next) {
 		if (family != item->family)
 			continue;
 		if (memcmp(address, &item->address, family_to_length(family)))
@@ -225,11 +297,11 @@ query_reverse(netresolve_query_t query, char **settings)
 		netresolve_backend_add_name_info(query, item->name, NULL);
 	}
 
+	netresolve_file_put(&hosts_cache, &index->file);
+
 	if (count) {
 		netresolve_backend_set_secure(query);
 		netresolve_backend_finished(query);
 	} else
 		netresolve_backend_failed(query);
-
-	free(list.items);
 }
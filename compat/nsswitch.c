@@ -36,17 +36,13 @@ _nss_netresolve_getaddrinfo(res_state state, const char *nodename, const char *s
 		const struct addrinfo *hints,
 		struct addrinfo **result, int32_t *ttl)
 {
-	netresolve_t context;
 	netresolve_query_t query;
 	int status = EAI_SYSTEM;
 
-	if (!(context = netresolve_context_new()))
-		return status;
-
-	if ((query = netresolve_query_getaddrinfo(context, nodename, servname, hints, NULL, NULL)))
+	/* The per-thread default context is reused across calls. */
+	if ((query = netresolve_query_getaddrinfo(NULL, nodename, servname, hints, NULL, NULL)))
 		status = netresolve_query_getaddrinfo_done(query, result, ttl);
 
-	netresolve_context_free(context);
 	return status;
 }
 
@@ -35,6 +35,8 @@
 #include <netdb.h>
 #include <nss.h>
 #include <poll.h>
+#include <time.h>
+#include <sys/stat.h>
 
 typedef struct netresolve_query *netresolve_query_t;
 typedef struct netresolve_watch *netresolve_timeout_t;
@@ -96,6 +98,8 @@ typedef void (*netresolve_backend_cleanup_t)(void *priv);
 
 void *netresolve_backend_new_priv(netresolve_query_t query, size_t size, netresolve_backend_cleanup_t cleanup);
 void *netresolve_backend_get_priv(netresolve_query_t query);
+void *netresolve_backend_new_instance(netresolve_query_t query, size_t size, netresolve_backend_cleanup_t cleanup);
+void *netresolve_backend_get_instance(netresolve_query_t query);
 void netresolve_backend_finished(netresolve_query_t query);
 void netresolve_backend_failed(netresolve_query_t query);
 
@@ -117,6 +121,42 @@ void netresolve_timeout_remove(netresolve_query_t query, netresolve_timeout_t ti
 #define debug(...) netresolve_log(0x40, __VA_ARGS__)
 void netresolve_log(int level, const char *fmt, ...);
 
+/* Configuration files
+ *
+ * Files are read and parsed once and shared by all queries in the process.
+ * The parsed data lives in a structure of `size` bytes that starts with
+ * struct netresolve_file. It is built by the parse callback, `data` being
+ * NULL when the file couldn't be read, and it is never modified afterwards.
+ * A changed file results in a new structure and the old one is cleaned up
+ * with its last reference. Files are checked for changes at most once per
+ * second.
+ */
+struct netresolve_file {
+	int refcount;
+	char *name;
+	char *path;
+	int error;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	char *data;
+};
+
+struct netresolve_file_cache {
+	size_t size;
+	bool (*parse)(struct netresolve_file *file);
+	void (*cleanup)(struct netresolve_file *file);
+	struct netresolve_file *current;
+	time_t checked;
+	/* Lookups currently taking a reference to `current`. */
+	int readers;
+};
+
+struct netresolve_file *netresolve_file_get(struct netresolve_file_cache *cache, const char *path, const char *fallback);
+void netresolve_file_put(struct netresolve_file_cache *cache, struct netresolve_file *file);
+void netresolve_file_clear(struct netresolve_file_cache *cache);
+
 /* Convenience */
 typedef union { struct in_addr address4; struct in6_addr address6; } Address;
 bool netresolve_backend_parse_address(const char *string_orig,
@@ -92,9 +92,16 @@ struct netresolve_epoll {
 
 struct netresolve_backend {
 	bool mandatory;
+	/* Owned by the shared backend chain. */
+	const char *name;
 	char **settings;
-	void *dl_handle;
+	struct netresolve_chain_item *item;
+	/* Members of a group of backends racing each other. */
+	struct netresolve_backend **group;
+	/* Filled in when the backend is first used. */
+	bool loaded;
 	void (*setup[_NETRSOLVE_REQUEST_TYPES])(netresolve_query_t query, char **settings);
+	/* Data shared by all queries using this backend instance. */
 	netresolve_backend_cleanup_t cleanup;
 	void *data;
 };
@@ -122,6 +129,7 @@ struct netresolve_path {
 		enum netresolve_socket_state state;
 		netresolve_watch_t watch;
 		int fd;
+		struct timespec started;
 	} socket;
 };
 
@@ -134,16 +142,35 @@ struct netresolve_query {
 		netresolve_timeout_callback_t timeout_callback;
 		void *data;
 		void *handle;
+		/* Timeouts are kept in the context timer heap. */
+		struct timespec deadline;
+		size_t heap_index;
 		struct netresolve_watch *previous, *next;
 	} watches;
 	netresolve_query_callback callback;
 	void *user_data;
 	enum netresolve_state state;
+	bool dispatching;
+	/* Freed from its own watch callback. */
+	bool freed;
+	bool cached;
+	/* Paths already handed over to the path callback. */
+	size_t reported;
+	struct netresolve_query *leader;
+	/* Query running a group of backends this query is racing for. */
+	struct netresolve_query *parent;
 	int nfds;
-	netresolve_timeout_t delayed;
+	bool queued;
+	struct netresolve_query *queue_previous, *queue_next;
 	netresolve_timeout_t request_timeout;
 	netresolve_timeout_t result_timeout;
+	/* Backend chain selected for the request and the current backend. */
+	struct netresolve_backend **backends;
 	struct netresolve_backend **backend;
+	struct {
+		netresolve_backend_cleanup_t cleanup;
+		void *data;
+	} priv;
 	struct netresolve_request {
 		enum netresolve_request_type type;
 		/* Perform L3 address resolution using 'nodename' if not NULL. Use
@@ -166,6 +193,16 @@ struct netresolve_query {
 		bool dns_srv_lookup;
 		bool dns_search;
 		int clamp_ttl;
+		/* Report paths as they are added */
+		netresolve_path_callback path_callback;
+		void *path_user_data;
+		/* Finish as soon as there are enough usable paths */
+		int max_paths;
+		/* Socket API */
+		int connect_window;
+		bool tcp_fastopen;
+		bool reuse_port;
+		int defer_accept;
 		/* Reverse query */
 		union {
 			char address[1024];
@@ -193,8 +230,6 @@ struct netresolve_query {
 		enum netresolve_security security;
 	} response;
 
-	struct netresolve_service_list *services;
-
 	union {
 		struct sockaddr sa;
 		struct sockaddr_in sin;
@@ -204,12 +239,54 @@ struct netresolve_query {
 	struct netresolve_query *previous, *next;
 };
 
+struct netresolve_cache_entry {
+	struct netresolve_request request;
+	struct netresolve_response response;
+	time_t stored;
+	time_t expires;
+	struct netresolve_cache_entry *previous, *next;
+};
+
 struct netresolve_context {
 	struct netresolve_query queries;
 	struct netresolve_request request;
+	struct netresolve_cache {
+		struct netresolve_cache_entry entries;
+		int count;
+	} cache;
 	struct netresolve_epoll epoll;
 	int nfds;
+	struct netresolve_timers {
+		netresolve_timeout_t *heap;
+		size_t count;
+		size_t reserved;
+		int fd;
+		struct timespec armed;
+		struct netresolve_watch watch;
+		bool watching;
+	} timers;
+	struct netresolve_runqueue {
+		struct netresolve_query *first, *last;
+		int fd;
+		struct netresolve_watch watch;
+		bool watching;
+	} runqueue;
+	struct netresolve_submit {
+		/* Pushed to by any thread without locking. */
+		struct netresolve_node *head;
+		struct netresolve_request request;
+		int fd;
+		struct netresolve_watch watch;
+		bool watching;
+	} submit;
+	struct netresolve_chain *chain;
 	struct netresolve_backend **backends;
+	struct netresolve_route {
+		char *label;
+		struct netresolve_chain *chain;
+		struct netresolve_backend **backends;
+		struct netresolve_route *children, *next;
+	} routes;
 	struct {
 		netresolve_watch_add_callback_t add_watch;
 		netresolve_watch_remove_callback_t remove_watch;
@@ -218,6 +295,12 @@ struct netresolve_context {
 	} callbacks;
 	struct netresolve_config {
 		int force_family;
+		int cache_size;
+		/* Happy Eyeballs connection parameters */
+		int connect_timeout;
+		int resolution_delay;
+		int connect_attempt_delay;
+		int connect_cooldown;
 	} config;
 };
 
@@ -227,18 +310,46 @@ netresolve_query_t netresolve_query(netresolve_t context, netresolve_query_callb
 const char *netresolve_query_state_to_string(enum netresolve_state state);
 void netresolve_query_set_state(netresolve_query_t query, enum netresolve_state state);
 void netresolve_query_dispatch(netresolve_query_t query, netresolve_watch_t watch, int fd, int events, void *data);
+netresolve_query_t netresolve_query_new(netresolve_t context, enum netresolve_request_type type);
+void netresolve_query_start(netresolve_query_t query);
+void netresolve_query_dispatch_deferred(netresolve_query_t query);
+bool netresolve_query_has_enough_paths(netresolve_query_t query);
 
 /* Request */
 bool netresolve_request_set_options_from_va(struct netresolve_request *request, va_list ap);
 bool netresolve_request_get_options_from_va(struct netresolve_request *request, va_list ap);
+void netresolve_request_copy(struct netresolve_request *target, const struct netresolve_request *source);
+bool netresolve_request_equal(const struct netresolve_request *request1, const struct netresolve_request *request2);
+
+/* Context */
+netresolve_t netresolve_context_get_default(void);
+
+/* Backends */
+void netresolve_backend_load(struct netresolve_backend *backend);
+struct netresolve_backend **netresolve_route_backends(netresolve_t context, const struct netresolve_request *request);
+void netresolve_backend_add_response(netresolve_query_t query, const struct netresolve_response *response);
+void netresolve_backend_sort_paths(struct netresolve_response *response);
+void netresolve_backend_order_by_weight(netresolve_query_t query);
+unsigned int netresolve_random(unsigned int max);
+
+/* Fast path */
+bool netresolve_fastpath(netresolve_query_t query);
+
+/* Cache */
+bool netresolve_cache_lookup(netresolve_query_t query);
+void netresolve_cache_store(netresolve_query_t query);
+void netresolve_cache_clear(netresolve_t context);
+void netresolve_response_copy(struct netresolve_response *target, const struct netresolve_response *source);
+
+/* Connection history */
+void netresolve_history_add(const struct netresolve_path *path, bool success, int rtt);
+int netresolve_history_rank(const struct netresolve_path *path, int cooldown);
+int netresolve_history_rtt(int family, int percentile);
 
 /* Services */
 struct netresolve_service_list;
 typedef void (*netresolve_service_callback)(const char *name, int socktype, int protocol, int port, void *user_data);
-struct netresolve_service_list *netresolve_service_list_new(const char *path);
-void netresolve_service_list_free(struct netresolve_service_list *services);
-void netresolve_service_list_query(struct netresolve_service_list **services,
-		const char *name, int socktype, int protocol, int port,
+void netresolve_service_list_query(const char *name, int socktype, int protocol, int port,
 		netresolve_service_callback callback, void *user_data);
 
 /* Utilities */
@@ -251,6 +362,21 @@ const char *netresolve_get_request_string(netresolve_query_t query);
 const char *netresolve_get_path_string(netresolve_query_t query, int i);
 const char *netresolve_get_response_string(netresolve_query_t query);
 
+/* Timers */
+void netresolve_timers_cleanup(netresolve_t context);
+
+/* Run queue */
+void netresolve_runqueue_add(netresolve_query_t query);
+void netresolve_runqueue_remove(netresolve_query_t query);
+void netresolve_runqueue_run(netresolve_t context);
+void netresolve_runqueue_cleanup(netresolve_t context);
+
+/* Submission from other threads */
+bool netresolve_submit_request(netresolve_t context, struct netresolve_request *take_request,
+		netresolve_query_callback callback, void *user_data);
+void netresolve_submit_wake(netresolve_t context);
+void netresolve_submit_cleanup(netresolve_t context);
+
 /* Event loop for blocking mode */
 bool netresolve_epoll_install(netresolve_t context,
 		struct netresolve_epoll *loop,
@@ -41,4 +41,15 @@ netresolve_query_t netresolve_listen(netresolve_t context,
 void netresolve_accept(netresolve_query_t query, netresolve_socket_callback_t on_accept, void *user_data);
 void netresolve_listen_free(netresolve_query_t query);
 
+typedef struct netresolve_connect_pool *netresolve_connect_pool_t;
+typedef void (*netresolve_connect_pool_callback_t)(netresolve_connect_pool_t pool, int sock, void *user_data);
+
+netresolve_connect_pool_t netresolve_connect_pool_new(netresolve_t context, int min_idle, int max_idle);
+void netresolve_connect_pool_free(netresolve_connect_pool_t pool);
+void netresolve_connect_pooled(netresolve_connect_pool_t pool,
+		const char *nodename, const char *servname,
+		int family, int socktype, int protocol,
+		netresolve_connect_pool_callback_t callback, void *user_data);
+bool netresolve_connect_release(netresolve_connect_pool_t pool, int sock, bool reuse);
+
 #endif /* NETRESOLVE_SOCKET_H */
@@ -0,0 +1,44 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef NETRESOLVE_SUBMIT_H
+#define NETRESOLVE_SUBMIT_H
+
+#include <netresolve.h>
+
+typedef struct netresolve_completion *netresolve_completion_t;
+
+bool netresolve_submit_setup(netresolve_t context);
+bool netresolve_submit(netresolve_t context, netresolve_completion_t completion, void *user_data,
+		enum netresolve_option type, ...);
+bool netresolve_submit_forward(netresolve_t context,
+		const char *nodename, const char *servname,
+		netresolve_completion_t completion, void *user_data);
+void netresolve_submit_free(netresolve_t context, netresolve_query_t query);
+
+netresolve_completion_t netresolve_completion_new(void);
+void netresolve_completion_free(netresolve_completion_t completion);
+int netresolve_completion_fd(netresolve_completion_t completion);
+netresolve_query_t netresolve_completion_next(netresolve_completion_t completion, void **user_data);
+
+#endif /* NETRESOLVE_SUBMIT_H */
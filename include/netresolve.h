@@ -44,6 +44,46 @@ enum netresolve_option {
  */
 	NETRESOLVE_OPTION_DEFAULT_LOOPBACK = 0x10, /* bool default_loopback */
 	NETRESOLVE_OPTION_DNS_SRV_LOOKUP, /* bool dns_srv_lookup */
+/* Path callback:
+ *
+ * Called with the index of each path added by a backend while the query
+ * is still running, from the event loop and before the query callback.
+ * Paths of such queries are kept in the order they were added so that the
+ * indexes stay valid. Paths taken over as a whole, e.g. from the cache,
+ * are only reported by the query callback. The callback may free the
+ * query, the remaining paths are not reported then.
+ */
+	NETRESOLVE_OPTION_PATH_CALLBACK = 0x20, /* netresolve_path_callback callback, void *user_data */
+/* Completion policy:
+ *
+ * NETRESOLVE_OPTION_MAX_PATHS:
+ *  - When positive, the query is finished as soon as it has the given
+ *    number of usable paths and any outstanding backend work is cancelled.
+ *    Use 1 when you only need the first good address.
+ */
+	NETRESOLVE_OPTION_MAX_PATHS = 0x30, /* int max_paths */
+/* Socket API:
+ *
+ * NETRESOLVE_OPTION_CONNECT_WINDOW:
+ *  - Maximum number of connection attempts `netresolve_connect()` keeps
+ *    in progress at a time, zero meaning no limit.
+ * NETRESOLVE_OPTION_TCP_FASTOPEN:
+ *  - When set, `netresolve_connect()` uses TCP Fast Open where available.
+ *    A connection to a server with a known cookie is passed to the
+ *    application before the handshake, which is then performed together
+ *    with sending the first data.
+ * NETRESOLVE_OPTION_REUSE_PORT:
+ *  - When set, `netresolve_listen()` sockets use `SO_REUSEPORT` so that
+ *    each worker loop can listen on the same addresses using its own
+ *    context and the kernel spreads connections between them.
+ * NETRESOLVE_OPTION_DEFER_ACCEPT:
+ *  - When positive, TCP connections are only accepted once data arrives
+ *    or after the given number of seconds.
+ */
+	NETRESOLVE_OPTION_CONNECT_WINDOW = 0x40, /* int connect_window */
+	NETRESOLVE_OPTION_TCP_FASTOPEN, /* bool tcp_fastopen */
+	NETRESOLVE_OPTION_REUSE_PORT, /* bool reuse_port */
+	NETRESOLVE_OPTION_DEFER_ACCEPT, /* int defer_accept */
 /* Node and service name:
  *
  * You don't normally need to set them as they are specified as parameters
@@ -84,10 +124,12 @@ void netresolve_context_free(netresolve_t context);
 
 /* Context configuration */
 void netresolve_set_backend_string(netresolve_t context, const char *string);
+void netresolve_set_route_string(netresolve_t context, const char *string);
 void netresolve_context_set_options(netresolve_t context, ...);
 
 /* Query construction and destruction */
 typedef void (*netresolve_query_callback)(netresolve_query_t query, void *user_data);
+typedef void (*netresolve_path_callback)(netresolve_query_t query, size_t idx, void *user_data);
 
 netresolve_query_t netresolve_query_forward(netresolve_t context,
 		const char *node, const char *service,
@@ -100,6 +142,22 @@ netresolve_query_t netresolve_query_dns(netresolve_t context,
 		netresolve_query_callback callback, void *user_data);
 void netresolve_query_free(netresolve_query_t query);
 
+/* Batch queries */
+struct netresolve_batch_request {
+	const char *node;
+	const char *service;
+	int family;
+	int socktype;
+	int protocol;
+};
+
+typedef void (*netresolve_batch_callback)(netresolve_query_t *queries, size_t count, void *user_data);
+
+bool netresolve_query_batch(netresolve_t context,
+		const struct netresolve_batch_request *requests, size_t count, size_t concurrency,
+		netresolve_query_t *queries,
+		netresolve_query_callback callback, netresolve_batch_callback done, void *user_data);
+
 /* Query result getters (forward queries) */
 size_t netresolve_query_get_count(const netresolve_query_t query);
 void netresolve_query_get_node_info(const netresolve_query_t query, size_t idx,
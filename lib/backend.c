@@ -22,6 +22,8 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <unistd.h>
+#include <stdint.h>
+#include <time.h>
 #include <string.h>
 #include <errno.h>
 #include <sys/epoll.h>
@@ -179,6 +181,12 @@ path_cmp(const struct netresolve_path *p1, const struct netresolve_path *p2)
 	if (!getenv_bool("NETRESOLVE_SORT_RESULTS", true))
 		return 0;
 
+	/* RFC 2782: Contact the target with the lowest priority first. Weights
+	 * are applied when the query is finished.
+	 */
+	if (p1->priority != p2->priority)
+		return p1->priority < p2->priority ? -1 : 1;
+
 	/* Rule 1: Avoid unusable destinations.
 	 * If DB is known to be unreachable or if Source(DB) is undefined, then
 	 * prefer DA.  Similarly, if DA is known to be unreachable or if
@@ -203,7 +211,14 @@ add_path(netresolve_query_t query, const struct netresolve_path *orig_path)
 {
 	struct netresolve_response *response = &query->response;
 	struct netresolve_path *path = memdup(orig_path, sizeof *orig_path);
-	int i;
+	struct netresolve_request *request = &query->request;
+	int i = response->pathcount;
+
+	/* The query is already being finished. */
+	if (netresolve_query_has_enough_paths(query)) {
+		free(path);
+		return;
+	}
 
 	/* Check reachability of the destination. */
 	check_reachability(path);
@@ -214,10 +229,14 @@ add_path(netresolve_query_t query, const struct netresolve_path *orig_path)
 	 * FIXME: Consider full compliance
 	 *
 	 * https://tools.ietf.org/html/rfc6724#section-6
+	 *
+	 * Paths already reported through the path callback must keep their
+	 * indexes and therefore aren't sorted.
 	 */
-	for (i = 0; i < response->pathcount; i++)
-		if (path_cmp(path, &response->paths[i]) < 0)
-			break;
+	if (!request->path_callback)
+		for (i = 0; i < response->pathcount; i++)
+			if (path_cmp(path, &response->paths[i]) < 0)
+				break;
 
 	response->paths = realloc(response->paths, (response->pathcount + 2) * sizeof *path);
 	memmove(&response->paths[i+1], &response->paths[i],
@@ -227,10 +246,33 @@ add_path(netresolve_query_t query, const struct netresolve_path *orig_path)
 
 	debug_query(query, "added path: %s", netresolve_get_path_string(query, i));
 
-	if (query->state == NETRESOLVE_STATE_WAITING)
-		netresolve_query_set_state(query, NETRESOLVE_STATE_WAITING_MORE);
+	/* Paths are reported from the event loop rather than from backend
+	 * code. A query being dispatched reports them when the watch callback
+	 * returns. Immediate answers are reported by the query callback.
+	 */
+	if (request->path_callback && query->state != NETRESOLVE_STATE_NONE && !query->dispatching)
+		netresolve_runqueue_add(query);
 
 	free(path);
+
+	/* Finish the query without waiting for outstanding backend work, which
+	 * is cancelled on the way to the DONE state.
+	 */
+	if (netresolve_query_has_enough_paths(query)) {
+		switch (query->state) {
+		case NETRESOLVE_STATE_SETUP:
+		case NETRESOLVE_STATE_WAITING:
+		case NETRESOLVE_STATE_WAITING_MORE:
+			netresolve_backend_finished(query);
+			break;
+		default:
+			break;
+		}
+		return;
+	}
+
+	if (query->state == NETRESOLVE_STATE_WAITING)
+		netresolve_query_set_state(query, NETRESOLVE_STATE_WAITING_MORE);
 }
 
 struct path_data {
@@ -295,8 +337,8 @@ netresolve_backend_add_path(netresolve_query_t query,
 	if (query->request.servname && (!socktype || !protocol || !port)) {
 		struct path_data data = { .query = query, .path = &path };
 
-		netresolve_service_list_query(&query->services,
-				request->servname, path.service.socktype, path.service.protocol, 0,
+		netresolve_service_list_query(request->servname,
+				path.service.socktype, path.service.protocol, 0,
 				path_callback, &data);
 		return;
 	}
@@ -337,8 +379,7 @@ netresolve_backend_add_name_info(netresolve_query_t query, const char *nodename,
 	if (!query->response.servname) {
 		int protocol = netresolve_backend_get_protocol(query);
 
-		netresolve_service_list_query(&query->services,
-				NULL, 0, protocol, query->request.port,
+		netresolve_service_list_query(NULL, 0, protocol, query->request.port,
 				service_callback, query);
 	}
 }
@@ -356,8 +397,61 @@ netresolve_backend_set_dns_answer(netresolve_query_t query, const void *answer,
 	query->response.dns.length = length;
 }
 
+/* netresolve_backend_add_response:
+ *
+ * Add the results of another query, e.g. of the member that won a backend
+ * group race, as if they were found by the backend being run.
+ */
+void
+netresolve_backend_add_response(netresolve_query_t query, const struct netresolve_response *response)
+{
+	for (size_t i = 0; i < response->pathcount; i++)
+		add_path(query, &response->paths[i]);
+
+	if (response->nodename && !query->response.nodename)
+		query->response.nodename = strdup(response->nodename);
+	if (response->servname && !query->response.servname)
+		query->response.servname = strdup(response->servname);
+	if (response->dns.answer && !query->response.dns.answer)
+		netresolve_backend_set_dns_answer(query, response->dns.answer, response->dns.length);
+	if (response->security == NETRESOLVE_SECURITY_SECURE)
+		netresolve_backend_set_secure(query);
+}
+
+/* netresolve_backend_new_priv:
+ *
+ * Allocate private data for a single query. The cleanup function is called
+ * and the data are freed when the query is finished with the backend.
+ */
 void *
 netresolve_backend_new_priv(netresolve_query_t query, size_t size, netresolve_backend_cleanup_t cleanup)
+{
+	assert(*query->backend);
+	assert(!query->priv.data);
+
+	query->priv.cleanup = cleanup;
+	query->priv.data = calloc(1, size);
+
+	if (!query->priv.data)
+		netresolve_backend_failed(query);
+
+	return query->priv.data;
+}
+
+void *
+netresolve_backend_get_priv(netresolve_query_t query)
+{
+	return query->priv.data;
+}
+
+/* netresolve_backend_new_instance:
+ *
+ * Allocate data shared by all queries run by the backend instance within
+ * the context, e.g. a resolver handle. The cleanup function is called and
+ * the data are freed when the backend is unloaded.
+ */
+void *
+netresolve_backend_new_instance(netresolve_query_t query, size_t size, netresolve_backend_cleanup_t cleanup)
 {
 	struct netresolve_backend *backend = *query->backend;
 
@@ -367,27 +461,117 @@ netresolve_backend_new_priv(netresolve_query_t query, size_t size, netresolve_ba
 	backend->cleanup = cleanup;
 	backend->data = calloc(1, size);
 
-	if (!backend->data)
-		netresolve_backend_failed(query);
-
 	return backend->data;
 }
 
 void *
-netresolve_backend_get_priv(netresolve_query_t query)
+netresolve_backend_get_instance(netresolve_query_t query)
 {
 	return (*query->backend)->data;
 }
 
+/* netresolve_random:
+ *
+ * Returns a random number between zero and `max` inclusive.
+ */
+unsigned int
+netresolve_random(unsigned int max)
+{
+	static __thread unsigned int seed;
+
+	if (!seed)
+		seed = time(NULL) ^ getpid() ^ (uintptr_t) &seed;
+
+	return rand_r(&seed) % (max + 1);
+}
+
+static void
+move_path(struct netresolve_path *paths, size_t to, size_t from)
+{
+	struct netresolve_path path = paths[from];
+
+	memmove(&paths[to + 1], &paths[to], (from - to) * sizeof *paths);
+	paths[to] = path;
+}
+
+/* netresolve_backend_sort_paths:
+ *
+ * Sort paths the way `add_path()` sorts them as they are added. Queries
+ * using the path callback keep the original order, their responses need
+ * to be sorted before they are shared with other queries.
+ */
+void
+netresolve_backend_sort_paths(struct netresolve_response *response)
+{
+	struct netresolve_path *paths = response->paths;
+	size_t i, j;
+
+	for (i = 1; i < response->pathcount; i++) {
+		for (j = 0; j < i; j++)
+			if (path_cmp(&paths[i], &paths[j]) < 0)
+				break;
+		move_path(paths, j, i);
+	}
+}
+
+/* netresolve_backend_order_by_weight:
+ *
+ * Order paths with the same priority using the weighted random selection
+ * from RFC 2782. Paths with zero weight are put first and thus only have
+ * a small chance to be selected before the others.
+ */
+void
+netresolve_backend_order_by_weight(netresolve_query_t query)
+{
+	struct netresolve_path *paths = query->response.paths;
+	size_t count = query->response.pathcount;
+	size_t start, end, pos, i;
+
+	for (start = 0; start < count; start = end) {
+		unsigned int total = 0;
+
+		for (end = start; end < count && paths[end].priority == paths[start].priority; end++)
+			total += paths[end].weight;
+		if (!total)
+			continue;
+
+		for (pos = i = start; i < end; i++)
+			if (!paths[i].weight)
+				move_path(paths, pos++, i);
+
+		for (pos = start; pos < end; pos++) {
+			unsigned int selected = netresolve_random(total);
+			unsigned int sum = 0;
+
+			for (i = pos; i < end - 1; i++)
+				if ((sum += paths[i].weight) >= selected)
+					break;
+
+			total -= paths[i].weight;
+			move_path(paths, pos, i);
+		}
+	}
+}
+
 void
 netresolve_backend_finished(netresolve_query_t query)
 {
+	/* Paths already reported through the path callback keep their
+	 * indexes.
+	 */
+	if (!query->request.path_callback)
+		netresolve_backend_order_by_weight(query);
+
 	netresolve_query_set_state(query, NETRESOLVE_STATE_RESOLVED);
 }
 
 void
 netresolve_backend_failed(netresolve_query_t query)
 {
+	/* Outstanding lookups may fail after the query got enough paths. */
+	if (query->state == NETRESOLVE_STATE_RESOLVED && netresolve_query_has_enough_paths(query))
+		return;
+
 	netresolve_query_set_state(query, NETRESOLVE_STATE_ERROR);
 }
 
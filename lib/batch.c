@@ -0,0 +1,170 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <netresolve-private.h>
+
+/* Batch queries
+ *
+ * A batch runs a list of forward requests in a single context with a
+ * bounded number of queries in progress. A new query is started each time
+ * one of them is finished.
+ */
+struct netresolve_batch {
+	netresolve_t context;
+	const struct netresolve_batch_request *requests;
+	netresolve_query_t *queries;
+	size_t count;
+	size_t concurrency;
+	size_t started;
+	size_t finished;
+	bool starting;
+	netresolve_query_callback callback;
+	netresolve_batch_callback done;
+	void *user_data;
+};
+
+static void start_queries(struct netresolve_batch *batch);
+
+static void
+check_batch(struct netresolve_batch *batch)
+{
+	if (batch->starting || batch->finished < batch->count)
+		return;
+
+	if (batch->done)
+		batch->done(batch->queries, batch->count, batch->user_data);
+	free(batch);
+}
+
+static void
+finish_item(netresolve_query_t query, void *user_data)
+{
+	struct netresolve_batch *batch = user_data;
+
+	/* More mandatory backends are going to be run. */
+	if (query->state != NETRESOLVE_STATE_DONE && query->state != NETRESOLVE_STATE_FAILED)
+		return;
+
+	query->callback = NULL;
+	query->user_data = NULL;
+	batch->finished++;
+
+	if (batch->callback)
+		batch->callback(query, batch->user_data);
+
+	start_queries(batch);
+	check_batch(batch);
+}
+
+static bool
+set_options(struct netresolve_request *request, ...)
+{
+	va_list ap;
+	bool ok;
+
+	va_start(ap, request);
+	ok = netresolve_request_set_options_from_va(request, ap);
+	va_end(ap);
+
+	return ok;
+}
+
+static void
+start_queries(struct netresolve_batch *batch)
+{
+	/* Queries finished right away are counted by the outer call. */
+	if (batch->starting)
+		return;
+
+	batch->starting = true;
+	while (batch->started < batch->count && batch->started - batch->finished < batch->concurrency) {
+		const struct netresolve_batch_request *request = &batch->requests[batch->started];
+		netresolve_query_t query = netresolve_query_new(batch->context, NETRESOLVE_REQUEST_FORWARD);
+
+		batch->queries[batch->started++] = query;
+
+		if (!query || !set_options(&query->request,
+					NETRESOLVE_OPTION_NODE_NAME, request->node,
+					NETRESOLVE_OPTION_SERVICE_NAME, request->service,
+					NETRESOLVE_OPTION_FAMILY, request->family,
+					NETRESOLVE_OPTION_SOCKTYPE, request->socktype,
+					NETRESOLVE_OPTION_PROTOCOL, request->protocol,
+					NULL)) {
+			if (query)
+				netresolve_query_free(query);
+			batch->queries[batch->started - 1] = NULL;
+			batch->finished++;
+			continue;
+		}
+
+		query->callback = finish_item;
+		query->user_data = batch;
+		netresolve_query_start(query);
+	}
+	batch->starting = false;
+}
+
+/* netresolve_query_batch:
+ *
+ * Run forward queries for an array of requests with at most `concurrency`
+ * of them in progress at a time, zero meaning no limit. Query handles are
+ * stored in the `queries` array as they are created, NULL for requests
+ * that couldn't be started. The optional `callback` is called for each
+ * finished query and `done` once all of them are finished. Both arrays
+ * must be kept until then. In blocking mode all the queries are run
+ * simultaneously and the function returns when they are finished. Free
+ * the queries using `netresolve_query_free()`.
+ */
+bool
+netresolve_query_batch(netresolve_t context,
+		const struct netresolve_batch_request *requests, size_t count, size_t concurrency,
+		netresolve_query_t *queries,
+		netresolve_query_callback callback, netresolve_batch_callback done, void *user_data)
+{
+	struct netresolve_batch *batch;
+
+	if (!context)
+		context = netresolve_context_get_default();
+	if (!context || !(batch = calloc(1, sizeof *batch)))
+		return false;
+
+	batch->context = context;
+	batch->requests = requests;
+	batch->queries = queries;
+	batch->count = count;
+	batch->concurrency = concurrency ? concurrency : count;
+	batch->callback = callback;
+	batch->done = done;
+	batch->user_data = user_data;
+
+	memset(queries, 0, count * sizeof *queries);
+
+	start_queries(batch);
+	check_batch(batch);
+
+	/* Wait for the context in blocking mode. */
+	if (context->callbacks.user_data == &context->epoll)
+		netresolve_epoll_wait(context);
+
+	return true;
+}
@@ -0,0 +1,352 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <netresolve-private.h>
+#include <string.h>
+#include <time.h>
+
+static time_t
+get_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec;
+}
+
+/* netresolve_response_copy:
+ *
+ * Deep copy of a response for another query. Socket API state is reset.
+ */
+void
+netresolve_response_copy(struct netresolve_response *target, const struct netresolve_response *source)
+{
+	memset(target, 0, sizeof *target);
+
+	if (source->paths) {
+		target->paths = memdup(source->paths, (source->pathcount + 1) * sizeof *source->paths);
+		target->pathcount = source->pathcount;
+		/* Socket API state is never shared between queries. */
+		for (int i = 0; i < target->pathcount; i++)
+			memset(&target->paths[i].socket, 0, sizeof target->paths[i].socket);
+	}
+	target->nodename = source->nodename ? strdup(source->nodename) : NULL;
+	target->servname = source->servname ? strdup(source->servname) : NULL;
+	if (source->dns.answer) {
+		target->dns.answer = memdup(source->dns.answer, source->dns.length);
+		target->dns.length = source->dns.length;
+	}
+	target->security = source->security;
+}
+
+static void
+free_entry(netresolve_t context, struct netresolve_cache_entry *entry)
+{
+	entry->previous->next = entry->next;
+	entry->next->previous = entry->previous;
+	context->cache.count--;
+
+	free(entry->request.nodename);
+	free(entry->request.servname);
+	free(entry->request.dns_name);
+	free(entry->response.paths);
+	free(entry->response.nodename);
+	free(entry->response.servname);
+	free(entry->response.dns.answer);
+	free(entry);
+}
+
+/* Lifetime of responses that carry no TTL, e.g. reverse queries. */
+#define DEFAULT_TTL 60
+
+#define DNS_HEADER_SIZE 12
+#define DNS_TYPE_SOA 6
+
+typedef void (*dns_ttl_callback)(unsigned char *ttl, int type, const unsigned char *rdata, size_t rdlength, void *data);
+
+static uint32_t
+read_uint32(const unsigned char *data)
+{
+	return (uint32_t) data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+static size_t
+skip_name(const unsigned char *message, size_t length, size_t pos)
+{
+	while (pos < length) {
+		unsigned char label = message[pos];
+
+		/* A compression pointer ends the name. */
+		if ((label & 0xc0) == 0xc0)
+			return pos + 2 <= length ? pos + 2 : 0;
+		pos += 1 + label;
+		if (!label)
+			return pos;
+	}
+
+	return 0;
+}
+
+/* walk_dns_ttls:
+ *
+ * Call back with the TTL field of each resource record in the answer and
+ * authority sections of a DNS message. The additional section is skipped
+ * as the EDNS pseudo-record uses the field for flags. Returns false for
+ * malformed messages.
+ */
+static bool
+walk_dns_ttls(unsigned char *message, size_t length, dns_ttl_callback callback, void *data)
+{
+	size_t pos = DNS_HEADER_SIZE;
+	int qdcount, rrcount;
+
+	if (length < DNS_HEADER_SIZE)
+		return false;
+
+	qdcount = message[4] << 8 | message[5];
+	rrcount = (message[6] << 8 | message[7]) + (message[8] << 8 | message[9]);
+
+	for (int i = 0; i < qdcount; i++) {
+		if (!(pos = skip_name(message, length, pos)) || pos + 4 > length)
+			return false;
+		pos += 4;
+	}
+
+	for (int i = 0; i < rrcount; i++) {
+		int type;
+		size_t rdlength;
+
+		if (!(pos = skip_name(message, length, pos)) || pos + 10 > length)
+			return false;
+		type = message[pos] << 8 | message[pos + 1];
+		rdlength = message[pos + 8] << 8 | message[pos + 9];
+		if (pos + 10 + rdlength > length)
+			return false;
+
+		callback(message + pos + 4, type, message + pos + 10, rdlength, data);
+		pos += 10 + rdlength;
+	}
+
+	return true;
+}
+
+static void
+min_dns_ttl(unsigned char *field, int type, const unsigned char *rdata, size_t rdlength, void *data)
+{
+	int *ttl = data;
+	uint32_t value = read_uint32(field);
+
+	/* RFC 2308: Negative answers are cached for the lower of the SOA TTL
+	 * and the SOA minimum field, which ends the record data.
+	 */
+	if (type == DNS_TYPE_SOA && rdlength >= 4 && read_uint32(rdata + rdlength - 4) < value)
+		value = read_uint32(rdata + rdlength - 4);
+	/* RFC 2181: Values with the most significant bit set mean zero. */
+	if (value > INT32_MAX)
+		value = 0;
+
+	if (*ttl == -1 || (int) value < *ttl)
+		*ttl = value;
+}
+
+static void
+age_dns_ttl(unsigned char *field, int type, const unsigned char *rdata, size_t rdlength, void *data)
+{
+	uint32_t age = *(int *) data;
+	uint32_t value = read_uint32(field);
+
+	value = value > INT32_MAX || value < age ? 0 : value - age;
+
+	field[0] = value >> 24;
+	field[1] = value >> 16;
+	field[2] = value >> 8;
+	field[3] = value;
+}
+
+/* get_ttl:
+ *
+ * Cache lifetime of a response in seconds. It is the lowest TTL of all
+ * paths and DNS answer records, bounded by NETRESOLVE_CLAMP_TTL when set.
+ * Responses carrying names only, e.g. those to reverse queries, are kept
+ * for DEFAULT_TTL seconds.
+ */
+static int
+get_ttl(netresolve_query_t query)
+{
+	const struct netresolve_response *response = &query->response;
+	int clamp_ttl = query->request.clamp_ttl;
+	int ttl = -1;
+
+	for (int i = 0; i < response->pathcount; i++)
+		if (ttl == -1 || response->paths[i].ttl < ttl)
+			ttl = response->paths[i].ttl;
+
+	if (response->dns.answer) {
+		int dns_ttl = -1;
+
+		if (walk_dns_ttls(response->dns.answer, response->dns.length, min_dns_ttl, &dns_ttl)
+				&& dns_ttl != -1 && (ttl == -1 || dns_ttl < ttl))
+			ttl = dns_ttl;
+	} else if (!response->pathcount && response->nodename)
+		ttl = DEFAULT_TTL;
+
+	if (!response->pathcount && !response->nodename && !response->dns.answer)
+		return 0;
+	if (clamp_ttl >= 0 && (ttl == -1 || clamp_ttl < ttl))
+		ttl = clamp_ttl;
+
+	return ttl > 0 ? ttl : 0;
+}
+
+/* netresolve_cache_lookup:
+ *
+ * Fill in the query response from a matching unexpired cache entry. Returns
+ * false when there's no such entry and the query has to be resolved using
+ * the backends.
+ */
+bool
+netresolve_cache_lookup(netresolve_query_t query)
+{
+	netresolve_t context = query->context;
+	struct netresolve_cache_entry *entries = &context->cache.entries;
+	struct netresolve_cache_entry *entry, *next;
+	time_t now;
+	int age;
+
+	if (!context->cache.count)
+		return false;
+
+	now = get_time();
+
+	for (entry = entries->next; entry != entries; entry = next) {
+		next = entry->next;
+
+		if (entry->expires <= now) {
+			debug_context(context, "cache: dropping expired entry %p", entry);
+			free_entry(context, entry);
+			continue;
+		}
+		if (!netresolve_request_equal(&entry->request, &query->request))
+			continue;
+		/* The entry may have been stored under a longer clamped TTL. */
+		age = now - entry->stored;
+		if (query->request.clamp_ttl >= 0 && age >= query->request.clamp_ttl)
+			continue;
+
+		/* Keep recently used entries at the front. */
+		entry->previous->next = entry->next;
+		entry->next->previous = entry->previous;
+		entry->previous = entries;
+		entry->next = entries->next;
+		entry->previous->next = entry->next->previous = entry;
+
+		netresolve_response_copy(&query->response, &entry->response);
+
+		/* Report the time to live left rather than the original one. */
+		for (int i = 0; i < query->response.pathcount; i++) {
+			struct netresolve_path *path = &query->response.paths[i];
+
+			path->ttl = path->ttl > age ? path->ttl - age : 0;
+		}
+		if (query->response.dns.answer)
+			walk_dns_ttls(query->response.dns.answer, query->response.dns.length, age_dns_ttl, &age);
+
+		netresolve_backend_order_by_weight(query);
+		query->cached = true;
+
+		/* No backend is going to be run for the query. */
+		while (*query->backend)
+			query->backend++;
+
+		debug_query(query, "cache: found entry %p (expires in %d seconds)", entry, (int) (entry->expires - now));
+
+		return true;
+	}
+
+	return false;
+}
+
+/* netresolve_cache_store:
+ *
+ * Remember the response of a successfully finished query for the lifetime
+ * derived from its TTL values. The least recently used entry is dropped when
+ * the cache is full.
+ */
+void
+netresolve_cache_store(netresolve_query_t query)
+{
+	netresolve_t context = query->context;
+	struct netresolve_cache_entry *entries = &context->cache.entries;
+	struct netresolve_cache_entry *entry;
+	int ttl;
+
+	if (query->cached || context->config.cache_size <= 0)
+		return;
+	if (!(ttl = get_ttl(query)))
+		return;
+
+	if (!(entry = calloc(1, sizeof *entry)))
+		return;
+
+	netresolve_request_copy(&entry->request, &query->request);
+	netresolve_response_copy(&entry->response, &query->response);
+	/* Paths reported by the path callback are kept unsorted. Weights are
+	 * applied on each lookup.
+	 */
+	if (query->request.path_callback)
+		netresolve_backend_sort_paths(&entry->response);
+	entry->stored = get_time();
+	entry->expires = entry->stored + ttl;
+
+	/* Replace an older response to the same request. */
+	for (struct netresolve_cache_entry *old = entries->next; old != entries; old = old->next) {
+		if (netresolve_request_equal(&old->request, &query->request)) {
+			free_entry(context, old);
+			break;
+		}
+	}
+
+	entry->previous = entries;
+	entry->next = entries->next;
+	entry->previous->next = entry->next->previous = entry;
+	context->cache.count++;
+
+	while (context->cache.count > context->config.cache_size)
+		free_entry(context, entries->previous);
+
+	debug_query(query, "cache: stored entry %p for %d seconds", entry, ttl);
+}
+
+/* netresolve_cache_clear:
+ *
+ * Drop all cached responses, e.g. when the backend configuration changes.
+ */
+void
+netresolve_cache_clear(netresolve_t context)
+{
+	struct netresolve_cache_entry *entries = &context->cache.entries;
+
+	while (entries->next != entries)
+		free_entry(context, entries->next);
+}
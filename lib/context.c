@@ -24,7 +24,9 @@
 #include <netresolve-private.h>
 #include <unistd.h>
 #include <string.h>
+#include <strings.h>
 #include <dlfcn.h>
+#include <pthread.h>
 
 netresolve_t
 netresolve_context_new(void)
@@ -39,14 +41,27 @@ netresolve_context_new(void)
 		return NULL;
 
 	context->queries.previous = context->queries.next = &context->queries;
+	context->cache.entries.previous = context->cache.entries.next = &context->cache.entries;
 	context->epoll.fd = -1;
+	context->timers.fd = -1;
+	context->runqueue.fd = -1;
+	context->submit.fd = -1;
 
 	context->config.force_family = getenv_family("NETRESOLVE_FORCE_FAMILY", AF_UNSPEC);
+	context->config.cache_size = getenv_int("NETRESOLVE_CACHE_SIZE", 256);
+	context->config.connect_timeout = getenv_int("NETRESOLVE_CONNECT_TIMEOUT", 15);
+	context->config.resolution_delay = getenv_int("NETRESOLVE_RESOLUTION_DELAY", 50);
+	context->config.connect_attempt_delay = getenv_int("NETRESOLVE_CONNECT_ATTEMPT_DELAY", 250);
+	context->config.connect_cooldown = getenv_int("NETRESOLVE_CONNECT_COOLDOWN", 60);
 
 	context->request.default_loopback = getenv_bool("NETRESOLVE_FLAG_DEFAULT_LOOPBACK", false);
 	context->request.clamp_ttl = getenv_int("NETRESOLVE_CLAMP_TTL", -1);
 	context->request.request_timeout = getenv_int("NETRESOLVE_REQUEST_TIMEOUT", 15000);
 	context->request.result_timeout = getenv_int("NETRESOLVE_RESULT_TIMEOUT", 5000);
+	context->request.connect_window = getenv_bool("NETRESOLVE_SEQUENTIAL_CONNECT", false) ? 1 : getenv_int("NETRESOLVE_CONNECT_WINDOW", 0);
+	context->request.tcp_fastopen = getenv_bool("NETRESOLVE_TCP_FASTOPEN", false);
+
+	netresolve_set_route_string(context, secure_getenv("NETRESOLVE_ROUTES"));
 
 	return context;
 }
@@ -58,10 +73,16 @@ netresolve_context_free(netresolve_t context)
 
 	debug_context(context, "destroying context");
 
+	netresolve_submit_cleanup(context);
+
 	while (queries->next != queries)
 		netresolve_query_free(queries->next);
 
+	netresolve_set_route_string(context, NULL);
 	netresolve_set_backend_string(context, "");
+	netresolve_cache_clear(context);
+	netresolve_timers_cleanup(context);
+	netresolve_runqueue_cleanup(context);
 
 	if (context->callbacks.cleanup)
 		context->callbacks.cleanup(context->callbacks.user_data);
@@ -70,6 +91,43 @@ netresolve_context_free(netresolve_t context)
 	free(context);
 }
 
+/* Default context
+ *
+ * Queries created without a context use a context private to the calling
+ * thread. It is created on first use, reused by subsequent queries and
+ * destroyed when the thread exits.
+ */
+static pthread_key_t default_context_key;
+static pthread_once_t default_context_once = PTHREAD_ONCE_INIT;
+static __thread netresolve_t default_context;
+
+static void
+free_default_context(void *data)
+{
+	default_context = NULL;
+	netresolve_context_free(data);
+}
+
+static void
+create_default_context_key(void)
+{
+	pthread_key_create(&default_context_key, free_default_context);
+}
+
+netresolve_t
+netresolve_context_get_default(void)
+{
+	if (default_context)
+		return default_context;
+
+	pthread_once(&default_context_once, create_default_context_key);
+
+	if ((default_context = netresolve_context_new()))
+		pthread_setspecific(default_context_key, default_context);
+
+	return default_context;
+}
+
 void
 netresolve_context_set_options(netresolve_t context, ...)
 {
@@ -80,67 +138,404 @@ netresolve_context_set_options(netresolve_t context, ...)
 	va_end(ap);
 }
 
+/* Backend registry
+ *
+ * Backend modules are loaded once per process and stay loaded. Parsed
+ * backend chains are shared by all contexts using the same backend string,
+ * each context only allocates lightweight backend objects pointing to them.
+ */
+struct netresolve_module {
+	char *name;
+	void *dl_handle;
+	void (*setup[_NETRSOLVE_REQUEST_TYPES])(netresolve_query_t query, char **settings);
+	struct netresolve_module *next;
+};
+
+struct netresolve_chain {
+	int refcount;
+	char *string;
+	struct netresolve_chain_item {
+		bool mandatory;
+		char **settings;
+		const char *name;
+		/* Backends started at the same time. */
+		struct netresolve_chain_item *members;
+		int nmembers;
+		/* Resolved on first use. */
+		bool loaded;
+		struct netresolve_module *module;
+	} *items;
+	int count;
+	struct netresolve_chain *next;
+};
+
+/* Unused chains are only dropped when there are too many of them. */
+#define MAX_CHAINS 16
+
+#ifdef USE_BUILTIN_BACKENDS
+#define BUILTIN_SETUP(forward, reverse) { \
+		[NETRESOLVE_REQUEST_FORWARD] = forward, \
+		[NETRESOLVE_REQUEST_REVERSE] = reverse, \
+	}
+
+void builtin_unix_forward(netresolve_query_t query, char **settings);
+void builtin_any_forward(netresolve_query_t query, char **settings);
+void builtin_any_reverse(netresolve_query_t query, char **settings);
+void builtin_loopback_forward(netresolve_query_t query, char **settings);
+void builtin_loopback_reverse(netresolve_query_t query, char **settings);
+void builtin_numerichost_forward(netresolve_query_t query, char **settings);
+void builtin_hosts_forward(netresolve_query_t query, char **settings);
+void builtin_hosts_reverse(netresolve_query_t query, char **settings);
+void builtin_hostname_forward(netresolve_query_t query, char **settings);
+
+/* Backends linked into the library, checked before trying dlopen(). */
+static struct netresolve_module builtin_modules[] = {
+	{ "unix", NULL, BUILTIN_SETUP(builtin_unix_forward, NULL) },
+	{ "any", NULL, BUILTIN_SETUP(builtin_any_forward, builtin_any_reverse) },
+	{ "loopback", NULL, BUILTIN_SETUP(builtin_loopback_forward, builtin_loopback_reverse) },
+	{ "numerichost", NULL, BUILTIN_SETUP(builtin_numerichost_forward, NULL) },
+	{ "hosts", NULL, BUILTIN_SETUP(builtin_hosts_forward, builtin_hosts_reverse) },
+	{ "hostname", NULL, BUILTIN_SETUP(builtin_hostname_forward, NULL) },
+	{ NULL }
+};
+#endif
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct netresolve_module *modules;
+static struct netresolve_chain *chains;
+static int nchains;
+
+static struct netresolve_module *
+load_module(const char *name)
+{
+	struct netresolve_module *module;
+	char filename[1024];
+	void *dl_handle;
+
+	for (module = modules; module; module = module->next)
+		if (!strcmp(module->name, name))
+			return module;
+
+#ifdef USE_BUILTIN_BACKENDS
+	for (module = builtin_modules; module->name; module++)
+		if (!strcmp(module->name, name))
+			return module;
+#endif
+
+	snprintf(filename, sizeof filename, "libnetresolve-backend-%s.so.0", name);
+	if (!(dl_handle = dlopen(filename, RTLD_NOW))) {
+		error("%s", dlerror());
+		return NULL;
+	}
+
+	if (!(module = calloc(1, sizeof *module)) || !(module->name = strdup(name))) {
+		free(module);
+		dlclose(dl_handle);
+		return NULL;
+	}
+
+	module->dl_handle = dl_handle;
+	module->setup[NETRESOLVE_REQUEST_FORWARD] = dlsym(dl_handle, "query_forward");
+	module->setup[NETRESOLVE_REQUEST_REVERSE] = dlsym(dl_handle, "query_reverse");
+	module->setup[NETRESOLVE_REQUEST_DNS] = dlsym(dl_handle, "query_dns");
+
+	module->next = modules;
+	modules = module;
+
+	debug("loaded backend module: %s", name);
+
+	return module;
+}
+
 static void
-free_backend(struct netresolve_backend *backend)
+free_settings(char **settings)
+{
+	if (!settings)
+		return;
+
+	for (char **p = settings; *p; p++)
+		free(*p);
+	free(settings);
+}
+
+static char **
+parse_settings(const char *start, const char *end)
+{
+	const char *setup;
+	char **settings = NULL;
+	int nsettings = 0;
+
+	for (setup = start; start <= end; start++) {
+		if (start == end || *start == ' ') {
+			settings = realloc(settings, (nsettings + 2) * sizeof *settings);
+			settings[nsettings++] = strndup(setup, start - setup);
+			settings[nsettings] = NULL;
+			setup = start + 1;
+		}
+	}
+
+	return settings;
+}
+
+static void free_item(struct netresolve_chain_item *item);
+
+/* parse_item:
+ *
+ * Parse a single backend with its settings, or a group of backends
+ * enclosed in braces and separated by commas that are run in parallel.
+ */
+static bool
+parse_item(struct netresolve_chain_item *item, const char *start, const char *end)
+{
+	memset(item, 0, sizeof *item);
+
+	if (start < end && *start == '+') {
+		item->mandatory = true;
+		start++;
+	}
+
+	if (start < end && *start == '{' && end[-1] == '}') {
+		const char *member;
+
+		/* The whole group is used as the backend name in debug messages. */
+		if (!(item->settings = calloc(2, sizeof *item->settings)) || !(*item->settings = strndup(start, end - start))) {
+			free_item(item);
+			return false;
+		}
+
+		for (member = ++start, end--; start <= end; start++) {
+			if (start == end || *start == ',') {
+				struct netresolve_chain_item *members;
+
+				if (!(members = realloc(item->members, (item->nmembers + 1) * sizeof *members)))
+					break;
+				item->members = members;
+				if (parse_item(&item->members[item->nmembers], member, start))
+					item->nmembers++;
+				member = start + 1;
+			}
+		}
+
+		if (!item->nmembers) {
+			free_item(item);
+			return false;
+		}
+		return true;
+	}
+
+	item->settings = parse_settings(start, end);
+	if (!item->settings || !*item->settings || !**item->settings) {
+		free_item(item);
+		return false;
+	}
+	item->name = *item->settings;
+
+	return true;
+}
+
+static void
+free_item(struct netresolve_chain_item *item)
+{
+	free_settings(item->settings);
+	for (int i = 0; i < item->nmembers; i++)
+		free_item(&item->members[i]);
+	free(item->members);
+}
+
+static struct netresolve_chain *
+parse_chain(const char *string)
+{
+	struct netresolve_chain *chain;
+	const char *setup, *end;
+
+	if (!(chain = calloc(1, sizeof *chain)))
+		return NULL;
+	if (!(chain->string = strdup(string))) {
+		free(chain);
+		return NULL;
+	}
+
+	for (setup = end = string; true; end++) {
+		if (*end == '|' || *end == '\0') {
+			struct netresolve_chain_item *items;
+
+			if (!(items = realloc(chain->items, (chain->count + 1) * sizeof *items)))
+				break;
+			chain->items = items;
+			if (parse_item(&chain->items[chain->count], setup, end))
+				chain->count++;
+			setup = end + 1;
+		}
+		if (*end == '\0') {
+			break;
+		}
+	}
+
+	return chain;
+}
+
+static void
+free_chain(struct netresolve_chain *chain)
+{
+	for (int i = 0; i < chain->count; i++)
+		free_item(&chain->items[i]);
+	free(chain->items);
+	free(chain->string);
+	free(chain);
+}
+
+static struct netresolve_chain *
+get_chain(const char *string)
+{
+	struct netresolve_chain *chain, **p;
+
+	pthread_mutex_lock(&registry_mutex);
+
+	for (chain = chains; chain; chain = chain->next)
+		if (!strcmp(chain->string, string))
+			goto out;
+
+	/* Make room by dropping unused chains. */
+	for (p = &chains; *p && nchains >= MAX_CHAINS;) {
+		if (!(*p)->refcount) {
+			chain = *p;
+			*p = chain->next;
+			free_chain(chain);
+			nchains--;
+		} else
+			p = &(*p)->next;
+	}
+
+	if ((chain = parse_chain(string))) {
+		chain->next = chains;
+		chains = chain;
+		nchains++;
+	}
+out:
+	if (chain)
+		chain->refcount++;
+	pthread_mutex_unlock(&registry_mutex);
+
+	return chain;
+}
+
+static void
+put_chain(struct netresolve_chain *chain)
 {
-	char **p;
+	pthread_mutex_lock(&registry_mutex);
+	chain->refcount--;
+	pthread_mutex_unlock(&registry_mutex);
+}
+
+/* netresolve_backend_load:
+ *
+ * Backend modules are only loaded when a query first reaches the
+ * backend, so that e.g. DNS libraries are never mapped by processes that
+ * only resolve local names. A module that fails to load leaves the setup
+ * functions unset and the backend is then skipped.
+ */
+void
+netresolve_backend_load(struct netresolve_backend *backend)
+{
+	struct netresolve_chain_item *item = backend->item;
+
+	if (backend->loaded || backend->group)
+		return;
 
+	pthread_mutex_lock(&registry_mutex);
+	if (!item->loaded) {
+		item->module = load_module(item->name);
+		item->loaded = true;
+	}
+	pthread_mutex_unlock(&registry_mutex);
+
+	if (item->module)
+		memcpy(backend->setup, item->module->setup, sizeof backend->setup);
+	backend->loaded = true;
+}
+
+static void
+free_backend(struct netresolve_backend *backend)
+{
 	if (!backend)
 		return;
-	if (backend->settings) {
-		for (p = backend->settings; *p; p++)
-			free(*p);
-		free(backend->settings);
+	if (backend->group) {
+		for (struct netresolve_backend **member = backend->group; *member; member++)
+			free_backend(*member);
+		free(backend->group);
 	}
-	if (backend->dl_handle)
-		dlclose(backend->dl_handle);
+	if (backend->cleanup)
+		backend->cleanup(backend->data);
+	free(backend->data);
 	free(backend);
 }
 
 static struct netresolve_backend *
-load_backend(char **take_settings)
+new_backend(struct netresolve_chain_item *item)
 {
 	struct netresolve_backend *backend = calloc(1, sizeof *backend);
-	const char *name;
-	char filename[1024];
+	int nmembers = 0;
 
 	if (!backend)
 		return NULL;
-	if (!take_settings || !*take_settings)
-		goto fail;
 
-	name = *take_settings;
-	if (*name == '+') {
-		backend->mandatory = true;
-		name++;
+	backend->mandatory = item->mandatory;
+	backend->name = item->name;
+	backend->settings = item->settings;
+	backend->item = item;
+
+	if (item->nmembers) {
+		if (!(backend->group = calloc(item->nmembers + 1, sizeof *backend->group))) {
+			free(backend);
+			return NULL;
+		}
+		for (int i = 0; i < item->nmembers; i++)
+			if ((backend->group[nmembers] = new_backend(&item->members[i])))
+				nmembers++;
 	}
 
-	backend->settings = take_settings;
-	snprintf(filename, sizeof filename, "libnetresolve-backend-%s.so.0", name);
-	backend->dl_handle = dlopen(filename, RTLD_NOW);
-	if (!backend->dl_handle) {
-		error("%s", dlerror());
-		goto fail;
+	return backend;
+}
+
+static struct netresolve_backend **
+new_backends(const char *string, struct netresolve_chain **chain)
+{
+	struct netresolve_backend **backends;
+	int nbackends = 0;
+
+	if (!(*chain = get_chain(string)))
+		return NULL;
+	if (!(backends = calloc((*chain)->count + 1, sizeof *backends))) {
+		put_chain(*chain);
+		*chain = NULL;
+		return NULL;
 	}
 
-	backend->setup[NETRESOLVE_REQUEST_FORWARD] = dlsym(backend->dl_handle, "query_forward");
-	backend->setup[NETRESOLVE_REQUEST_REVERSE] = dlsym(backend->dl_handle, "query_reverse");
-	backend->setup[NETRESOLVE_REQUEST_DNS] = dlsym(backend->dl_handle, "query_dns");
+	for (int i = 0; i < (*chain)->count; i++) {
+		struct netresolve_backend *backend = new_backend(&(*chain)->items[i]);
 
-	return backend;
-fail:
-	free_backend(backend);
-	return NULL;
+		if (backend)
+			backends[nbackends++] = backend;
+	}
+
+	return backends;
+}
+
+static void
+free_backends(struct netresolve_backend **backends, struct netresolve_chain *chain)
+{
+	if (backends) {
+		for (struct netresolve_backend **backend = backends; *backend; backend++)
+			free_backend(*backend);
+		free(backends);
+	}
+	if (chain)
+		put_chain(chain);
 }
 
 void
 netresolve_set_backend_string(netresolve_t context, const char *string)
 {
-	const char *setup, *end;
-	char **settings = NULL;
-	int nsettings = 0;
-	int nbackends = 0;
-
 	/* Default */
 	if (string == NULL)
 		string =
@@ -152,43 +547,187 @@ netresolve_set_backend_string(netresolve_t context, const char *string)
 #endif
 			;
 
-	/* Clear old backends */
-	if (context->backends) {
-		struct netresolve_backend **backend;
+	/* Responses from the old backends are no longer valid. */
+	netresolve_cache_clear(context);
 
-		for (backend = context->backends; *backend; backend++)
-			free_backend(*backend);
-		free(context->backends);
-		context->backends = NULL;
-	}
+	/* Clear old backends */
+	free_backends(context->backends, context->chain);
+	context->backends = NULL;
+	context->chain = NULL;
 
 	/* Empty string suggest we only clean up. */
 	if (!*string)
 		return;
 
 	/* Install new set of backends */
-	for (setup = end = string; true; end++) {
-		if (*end == ' ' || *end == '|' || *end == '\0') {
-			settings = realloc(settings, (nsettings + 2) * sizeof *settings);
-			settings[nsettings++] = strndup(setup, end - setup);
-			settings[nsettings] = NULL;
-			setup = end + 1;
+	context->backends = new_backends(string, &context->chain);
+}
+
+/* Routes
+ *
+ * Routes map domain name suffixes to their own backend chains. They are
+ * kept in a trie indexed by labels starting from the top level domain, so
+ * that the most specific route for a name is found in a single pass over
+ * its labels.
+ */
+static struct netresolve_route *
+find_route(struct netresolve_route *parent, const char *label, size_t length)
+{
+	struct netresolve_route *route;
+
+	for (route = parent->children; route; route = route->next)
+		if (!strncasecmp(route->label, label, length) && !route->label[length])
+			return route;
+
+	return NULL;
+}
+
+/* previous_label:
+ *
+ * Iterate over labels of a domain name from the right, ignoring the
+ * trailing dot. Returns false when there are no more labels.
+ */
+static bool
+previous_label(const char *name, const char **label, const char **end)
+{
+	if (!*end) {
+		*end = name + strlen(name);
+		if (*end > name && (*end)[-1] == '.')
+			(*end)--;
+	} else if (*label > name)
+		*end = *label - 1;
+	else
+		return false;
+
+	if (*end <= name)
+		return false;
+
+	for (*label = *end; *label > name && (*label)[-1] != '.'; (*label)--)
+		;
+
+	return true;
+}
+
+static void
+free_routes(struct netresolve_route *route)
+{
+	while (route) {
+		struct netresolve_route *next = route->next;
+
+		free_routes(route->children);
+		free_backends(route->backends, route->chain);
+		free(route->label);
+		free(route);
+
+		route = next;
+	}
+}
+
+static void
+add_route(netresolve_t context, const char *suffix, const char *string)
+{
+	struct netresolve_route *parent = &context->routes, *route;
+	const char *label = NULL, *end = NULL;
+
+	if (!strncmp(suffix, "*.", 2))
+		suffix++;
+	if (*suffix == '.')
+		suffix++;
+
+	while (previous_label(suffix, &label, &end)) {
+		if (!(route = find_route(parent, label, end - label))) {
+			if (!(route = calloc(1, sizeof *route)))
+				return;
+			if (!(route->label = strndup(label, end - label))) {
+				free(route);
+				return;
+			}
+			route->next = parent->children;
+			parent->children = route;
 		}
-		if (*end == '|' || *end == '\0') {
-			if (settings && *settings && **settings) {
-				context->backends = realloc(context->backends, (nbackends + 2) * sizeof *context->backends);
-				context->backends[nbackends] = load_backend(settings);
-				if (context->backends[nbackends]) {
-					nbackends++;
-					context->backends[nbackends] = NULL;
-				}
-			} else
-				free(settings);
-			nsettings = 0;
-			settings = NULL;
+		parent = route;
+	}
+
+	if (parent == &context->routes) {
+		error("Cannot route an empty suffix to '%s'.", string);
+		return;
+	}
+
+	free_backends(parent->backends, parent->chain);
+	parent->backends = new_backends(string, &parent->chain);
+}
+
+/* netresolve_set_route_string:
+ *
+ * Configure backend chains for specific domains. Routes are separated by
+ * semicolons and each of them consists of a domain name suffix and a
+ * backend string separated by an equal sign, e.g.
+ * `local=avahi;corp.example.net=hosts|ubdns`. Names not covered by any
+ * route are resolved using the backend string of the context. Empty string
+ * removes all routes.
+ */
+void
+netresolve_set_route_string(netresolve_t context, const char *string)
+{
+	const char *rule, *end;
+
+	/* Responses may come from different backends now. */
+	netresolve_cache_clear(context);
+
+	free_routes(context->routes.children);
+	context->routes.children = NULL;
+
+	if (!string)
+		return;
+
+	for (rule = end = string; true; end++) {
+		if (*end == ';' || *end == '\0') {
+			char *copy = strndup(rule, end - rule);
+			char *backends;
+
+			if (copy && (backends = strchr(copy, '='))) {
+				*backends++ = '\0';
+				add_route(context, copy, backends);
+			} else if (copy && *copy)
+				error("Cannot parse route '%s'.", copy);
+			free(copy);
+
+			rule = end + 1;
 		}
-		if (*end == '\0') {
+		if (*end == '\0')
 			break;
-		}
 	}
 }
+
+/* netresolve_route_backends:
+ *
+ * Find the backend chain for a request using the most specific route
+ * matching the queried name, or the backend chain of the context.
+ */
+struct netresolve_backend **
+netresolve_route_backends(netresolve_t context, const struct netresolve_request *request)
+{
+	struct netresolve_route *route = &context->routes;
+	struct netresolve_backend **backends = context->backends;
+	const char *name, *label = NULL, *end = NULL;
+
+	switch (request->type) {
+	case NETRESOLVE_REQUEST_FORWARD:
+		name = request->nodename;
+		break;
+	case NETRESOLVE_REQUEST_DNS:
+		name = request->dns_name;
+		break;
+	default:
+		name = NULL;
+	}
+
+	if (!name || !route->children)
+		return backends;
+
+	while (previous_label(name, &label, &end) && (route = find_route(route, label, end - label)))
+		if (route->backends && *route->backends)
+			backends = route->backends;
+
+	return backends;
+}
@@ -229,6 +229,11 @@ netresolve_epoll_wait(netresolve_t context)
 {
 	struct netresolve_epoll *loop = netresolve_get_user_data(context);
 
-	while (loop->count > 0)
+	/* Deferred state changes are run before waiting for events. */
+	while (true) {
+		netresolve_runqueue_run(context);
+		if (!loop->count)
+			break;
 		dispatch_events(context, -1);
+	}
 }
@@ -24,7 +24,9 @@
 #include <netresolve-private.h>
 #include <poll.h>
 #include <sys/timerfd.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
+#include <time.h>
 
 void
 netresolve_set_fd_callbacks(netresolve_t context,
@@ -110,6 +112,277 @@ netresolve_watch_remove(netresolve_query_t query, netresolve_watch_t watch, bool
 	free(watch);
 }
 
+static bool
+deadline_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* Timer heap
+ *
+ * All timeouts of a context are kept in a binary min-heap ordered by their
+ * deadlines. A single timerfd is armed to the earliest deadline and it is
+ * only watched while there are any timeouts so that the event loop doesn't
+ * wait for it in vain. Heap indexes stored in the timeouts are one-based,
+ * zero means the timeout is not in the heap.
+ */
+static void
+heap_set(struct netresolve_timers *timers, size_t i, netresolve_timeout_t timeout)
+{
+	timers->heap[i - 1] = timeout;
+	timeout->heap_index = i;
+}
+
+static void
+heap_up(struct netresolve_timers *timers, size_t i)
+{
+	netresolve_timeout_t timeout = timers->heap[i - 1];
+
+	for (; i > 1 && deadline_before(&timeout->deadline, &timers->heap[i / 2 - 1]->deadline); i /= 2)
+		heap_set(timers, i, timers->heap[i / 2 - 1]);
+
+	heap_set(timers, i, timeout);
+}
+
+static void
+heap_down(struct netresolve_timers *timers, size_t i)
+{
+	netresolve_timeout_t timeout = timers->heap[i - 1];
+	size_t child;
+
+	for (; (child = 2 * i) <= timers->count; i = child) {
+		if (child < timers->count && deadline_before(&timers->heap[child]->deadline, &timers->heap[child - 1]->deadline))
+			child++;
+		if (!deadline_before(&timers->heap[child - 1]->deadline, &timeout->deadline))
+			break;
+		heap_set(timers, i, timers->heap[child - 1]);
+	}
+
+	heap_set(timers, i, timeout);
+}
+
+static void
+heap_remove(struct netresolve_timers *timers, netresolve_timeout_t timeout)
+{
+	size_t i = timeout->heap_index;
+	netresolve_timeout_t last = timers->heap[--timers->count];
+
+	assert(i);
+	timeout->heap_index = 0;
+
+	if (last == timeout)
+		return;
+
+	heap_set(timers, i, last);
+	heap_up(timers, i);
+	heap_down(timers, last->heap_index);
+}
+
+static void dispatch_timers(netresolve_query_t query, netresolve_watch_t watch, int fd, int events, void *data);
+
+/* update_timers:
+ *
+ * Arm the timerfd to the earliest deadline and watch it. Removed timeouts
+ * don't cause rearming, the timer would just fire early and be rearmed.
+ */
+static void
+update_timers(netresolve_t context)
+{
+	struct netresolve_timers *timers = &context->timers;
+
+	if (!timers->count) {
+		if (timers->watching) {
+			context->callbacks.remove_watch(context, timers->fd, timers->watch.handle);
+			timers->watching = false;
+			debug_context(context, "stopped watching timers");
+		}
+		return;
+	}
+
+	if (timers->heap[0]->deadline.tv_sec != timers->armed.tv_sec || timers->heap[0]->deadline.tv_nsec != timers->armed.tv_nsec) {
+		struct itimerspec timerspec = { { 0, 0 }, timers->heap[0]->deadline };
+
+		if (timerfd_settime(timers->fd, TFD_TIMER_ABSTIME, &timerspec, NULL) == -1) {
+			error("timerfd_settime: %s", strerror(errno));
+			abort();
+		}
+		timers->armed = timers->heap[0]->deadline;
+	}
+
+	if (!timers->watching) {
+		timers->watch.fd = timers->fd;
+		timers->watch.callback = dispatch_timers;
+		timers->watch.data = context;
+		timers->watch.handle = context->callbacks.add_watch(context, timers->fd, POLLIN, &timers->watch);
+		timers->watching = true;
+		debug_context(context, "watching timers: fd=%d", timers->fd);
+	}
+}
+
+static void
+dispatch_timers(netresolve_query_t query, netresolve_watch_t watch, int fd, int events, void *data)
+{
+	netresolve_t context = data;
+	struct netresolve_timers *timers = &context->timers;
+	struct timespec now;
+	uint64_t expirations;
+
+	if (read(timers->fd, &expirations, sizeof expirations) == -1 && errno != EAGAIN)
+		error("timerfd read: %s", strerror(errno));
+	memset(&timers->armed, 0, sizeof timers->armed);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	while (timers->count && !deadline_before(&now, &timers->heap[0]->deadline)) {
+		netresolve_timeout_t timeout = timers->heap[0];
+
+		heap_remove(timers, timeout);
+
+		debug_query(timeout->query, "timeout expired: %p", timeout);
+
+		netresolve_query_dispatch(timeout->query, timeout, -1, POLLIN, timeout->data);
+	}
+
+	update_timers(context);
+}
+
+void
+netresolve_timers_cleanup(netresolve_t context)
+{
+	struct netresolve_timers *timers = &context->timers;
+
+	assert(!timers->count);
+
+	update_timers(context);
+
+	if (timers->fd != -1)
+		close(timers->fd);
+	timers->fd = -1;
+
+	free(timers->heap);
+	timers->heap = NULL;
+	timers->reserved = 0;
+}
+
+/* Run queue
+ *
+ * Queries with a state change deferred to the next main loop iteration are
+ * queued in the context. In blocking mode the queue is drained by the
+ * internal main loop without any system calls. Otherwise an eventfd is
+ * watched while the queue is non-empty. Its counter is never read so that
+ * it stays readable and the main loop keeps calling us.
+ */
+static void dispatch_runqueue(netresolve_query_t query, netresolve_watch_t watch, int fd, int events, void *data);
+
+static void
+update_runqueue(netresolve_t context)
+{
+	struct netresolve_runqueue *runqueue = &context->runqueue;
+
+	if (!runqueue->first) {
+		if (runqueue->watching) {
+			context->callbacks.remove_watch(context, runqueue->fd, runqueue->watch.handle);
+			runqueue->watching = false;
+		}
+		return;
+	}
+
+	if (runqueue->watching || context->callbacks.user_data == &context->epoll)
+		return;
+
+	if (runqueue->fd == -1 && (runqueue->fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		error("eventfd: %s", strerror(errno));
+		abort();
+	}
+
+	runqueue->watch.fd = runqueue->fd;
+	runqueue->watch.callback = dispatch_runqueue;
+	runqueue->watch.data = context;
+	runqueue->watch.handle = context->callbacks.add_watch(context, runqueue->fd, POLLIN, &runqueue->watch);
+	runqueue->watching = true;
+}
+
+void
+netresolve_runqueue_add(netresolve_query_t query)
+{
+	struct netresolve_runqueue *runqueue = &query->context->runqueue;
+
+	if (query->queued)
+		return;
+
+	debug_query(query, "deferring state change");
+
+	query->queued = true;
+	query->queue_next = NULL;
+	query->queue_previous = runqueue->last;
+	if (runqueue->last)
+		runqueue->last->queue_next = query;
+	else
+		runqueue->first = query;
+	runqueue->last = query;
+
+	update_runqueue(query->context);
+}
+
+void
+netresolve_runqueue_remove(netresolve_query_t query)
+{
+	struct netresolve_runqueue *runqueue = &query->context->runqueue;
+
+	if (!query->queued)
+		return;
+
+	if (query->queue_previous)
+		query->queue_previous->queue_next = query->queue_next;
+	else
+		runqueue->first = query->queue_next;
+	if (query->queue_next)
+		query->queue_next->queue_previous = query->queue_previous;
+	else
+		runqueue->last = query->queue_previous;
+
+	query->queued = false;
+	query->queue_previous = query->queue_next = NULL;
+
+	update_runqueue(query->context);
+}
+
+/* netresolve_runqueue_run:
+ *
+ * Run all deferred state changes including those queued meanwhile.
+ */
+void
+netresolve_runqueue_run(netresolve_t context)
+{
+	struct netresolve_runqueue *runqueue = &context->runqueue;
+
+	while (runqueue->first) {
+		netresolve_query_t query = runqueue->first;
+
+		netresolve_runqueue_remove(query);
+		netresolve_query_dispatch_deferred(query);
+	}
+}
+
+static void
+dispatch_runqueue(netresolve_query_t query, netresolve_watch_t watch, int fd, int events, void *data)
+{
+	netresolve_runqueue_run(data);
+}
+
+void
+netresolve_runqueue_cleanup(netresolve_t context)
+{
+	struct netresolve_runqueue *runqueue = &context->runqueue;
+
+	assert(!runqueue->first);
+	assert(!runqueue->watching);
+
+	if (runqueue->fd != -1)
+		close(runqueue->fd);
+	runqueue->fd = -1;
+}
+
 static void
 timeout_watch_callback(netresolve_query_t query, netresolve_watch_t watch, int fd, int events, void *data)
 {
@@ -120,30 +393,55 @@ netresolve_timeout_t
 netresolve_timeout_add(netresolve_query_t query, time_t sec, long nsec,
 		netresolve_timeout_callback_t callback, void *data)
 {
-	netresolve_watch_t watch;
-	int fd;
-	struct itimerspec timerspec = {{0, 0}, {sec, (sec != 0 || nsec != 0) ? nsec : 1}};
+	netresolve_t context = query->context;
+	struct netresolve_timers *timers = &context->timers;
+	struct netresolve_watch *watches = &query->watches;
+	netresolve_timeout_t timeout;
 
-	if ((fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK)) == -1)
+	if (timers->fd == -1 && (timers->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
 		return NULL;
 
-	if (timerfd_settime(fd, 0, &timerspec, NULL) == -1) {
-		close(fd);
-		return NULL;
+	if (timers->count == timers->reserved) {
+		size_t reserved = timers->reserved ? 2 * timers->reserved : 64;
+		netresolve_timeout_t *heap = realloc(timers->heap, reserved * sizeof *heap);
+
+		if (!heap)
+			return NULL;
+		timers->heap = heap;
+		timers->reserved = reserved;
 	}
 
-	debug_query(query, "adding timeout: fd=%d sec=%d nsec=%ld", fd, (int) sec, nsec);
+	if (!(timeout = calloc(1, sizeof *timeout)))
+		abort();
 
-	watch = netresolve_watch_add(query, fd, POLLIN, NULL, data);
+	timeout->query = query;
+	timeout->fd = -1;
+	timeout->data = data;
+	if (callback) {
+		timeout->callback = timeout_watch_callback;
+		timeout->timeout_callback = callback;
+	}
 
-	if (watch && callback) {
-		watch->callback = timeout_watch_callback;
-		watch->timeout_callback = callback;
+	clock_gettime(CLOCK_MONOTONIC, &timeout->deadline);
+	timeout->deadline.tv_sec += sec + nsec / 1000000000L;
+	timeout->deadline.tv_nsec += nsec % 1000000000L;
+	if (timeout->deadline.tv_nsec >= 1000000000L) {
+		timeout->deadline.tv_sec++;
+		timeout->deadline.tv_nsec -= 1000000000L;
 	}
 
-	assert(watch);
+	timeout->previous = watches->previous;
+	timeout->next = watches;
+	timeout->previous->next = timeout->next->previous = timeout;
+	query->nfds++;
 
-	return watch;
+	timers->heap[timers->count++] = timeout;
+	heap_up(timers, timers->count);
+	update_timers(context);
+
+	debug_query(query, "added timeout: %p sec=%d nsec=%ld (total %zu)", timeout, (int) sec, nsec, timers->count);
+
+	return timeout;
 }
 
 netresolve_timeout_t
@@ -156,16 +454,36 @@ netresolve_timeout_add_ms(netresolve_query_t query, time_t msec,
 void
 netresolve_timeout_remove(netresolve_query_t query, netresolve_timeout_t timeout)
 {
-	debug_query(query, "removing timeout: %p timeoutfd=%d", timeout, timeout->fd);
+	struct netresolve_timers *timers = &query->context->timers;
+
+	debug_query(query, "removing timeout: %p", timeout);
 
-	netresolve_watch_remove(query, timeout, true);
+	assert(query->nfds > 0);
+	assert(timeout->fd == -1);
+
+	timeout->previous->next = timeout->next;
+	timeout->next->previous = timeout->previous;
+	query->nfds--;
+
+	if (timeout->heap_index) {
+		heap_remove(timers, timeout);
+		update_timers(query->context);
+	}
+
+	memset(timeout, 0, sizeof *timeout);
+	free(timeout);
 }
 
 void
 netresolve_dispatch(netresolve_t context, netresolve_watch_t watch, int events)
 {
 	assert(watch);
-	assert(watch->query);
+
+	/* Context level watch */
+	if (!watch->query) {
+		watch->callback(NULL, watch, watch->fd, events, watch->data);
+		return;
+	}
 
 	debug_query(watch->query, "dispatching: fd=%d events=%d watch=%p", watch->fd, events, watch);
 
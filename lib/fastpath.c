@@ -0,0 +1,158 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <netresolve-private.h>
+#include <string.h>
+
+/* Fast path
+ *
+ * The trivial backends below answer requests without any external data.
+ * When the backend chain of a query starts with them, the response is
+ * filled in directly instead of loading the backends and running them
+ * through the state machine. Each function must give the same answer as
+ * the backend of the same name.
+ */
+static bool
+answer_unix(netresolve_query_t query)
+{
+	const char *node = query->request.nodename;
+
+	if (query->request.family != AF_UNIX || !node || *node != '/')
+		return false;
+
+	netresolve_backend_add_path(query, AF_UNIX, node, 0, query->request.socktype, 0, 0, 0, 0, 0);
+	return true;
+}
+
+static bool
+answer_any(netresolve_query_t query)
+{
+	const char *node = query->request.nodename;
+
+	if (query->request.default_loopback || (node && *node))
+		return false;
+
+	netresolve_backend_add_path(query, AF_INET, &inaddr_any, 0, 0, 0, 0, 0, 0, 0);
+	netresolve_backend_add_path(query, AF_INET6, &in6addr_any, 0, 0, 0, 0, 0, 0, 0);
+	return true;
+}
+
+static bool
+answer_loopback(netresolve_query_t query)
+{
+	const char *node = query->request.nodename;
+	bool ipv4 = !node || !*node || !strcmp(node, "localhost") || !strcmp(node, "localhost4");
+	bool ipv6 = !node || !*node || !strcmp(node, "localhost") || !strcmp(node, "localhost6");
+
+	if (!ipv4 && !ipv6)
+		return false;
+
+	netresolve_backend_set_canonical_name(query, "localhost");
+	if (ipv4)
+		netresolve_backend_add_path(query, AF_INET, &inaddr_loopback, 0, 0, 0, 0, 0, 0, 0);
+	if (ipv6)
+		netresolve_backend_add_path(query, AF_INET6, &in6addr_loopback, 0, 0, 0, 0, 0, 0, 0);
+	return true;
+}
+
+static bool
+answer_numerichost(netresolve_query_t query)
+{
+	const char *node = query->request.nodename;
+	Address address;
+	int family;
+	int ifindex;
+
+	if (!netresolve_backend_parse_address(node, &address, &family, &ifindex) || ifindex < 0)
+		return false;
+
+	netresolve_backend_add_path(query, family, &address, ifindex, 0, 0, 0, 0, 0, 0);
+	netresolve_backend_set_canonical_name(query, node);
+	return true;
+}
+
+static const struct {
+	const char *name;
+	bool (*answer)(netresolve_query_t query);
+} fastpaths[] = {
+	{ "unix", answer_unix },
+	{ "any", answer_any },
+	{ "loopback", answer_loopback },
+	{ "numerichost", answer_numerichost },
+	{ NULL, NULL }
+};
+
+static bool (*get_answer(const struct netresolve_backend *backend))(netresolve_query_t query)
+{
+	const char *name = backend->name;
+
+	if (!name)
+		return NULL;
+
+	for (int i = 0; fastpaths[i].name; i++)
+		if (!strcmp(fastpaths[i].name, name))
+			return fastpaths[i].answer;
+
+	return NULL;
+}
+
+/* netresolve_fastpath:
+ *
+ * Try to answer a forward query using the trivial backends at the start of
+ * its backend chain. Returns true when the response is complete and no
+ * backend needs to be run for the query.
+ */
+bool
+netresolve_fastpath(netresolve_query_t query)
+{
+	struct netresolve_backend **backend;
+
+	if (query->request.type != NETRESOLVE_REQUEST_FORWARD)
+		return false;
+
+	/* Mandatory backends have to be run anyway. */
+	for (backend = query->backends + 1; *backend; backend++)
+		if ((*backend)->mandatory)
+			return false;
+
+	for (backend = query->backends; *backend; backend++) {
+		bool (*answer)(netresolve_query_t query) = get_answer(*backend);
+
+		if (!answer)
+			return false;
+		if (answer(query))
+			break;
+	}
+	if (!*backend)
+		return false;
+
+	netresolve_backend_set_secure(query);
+
+	/* No backend is going to be run for the query. */
+	while (*query->backend)
+		query->backend++;
+
+	debug_query(query, "answered by the %s fast path", (*backend)->name);
+
+	return true;
+}
@@ -0,0 +1,234 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <netresolve-private.h>
+#include <unistd.h>
+#include <sched.h>
+
+/* Minimum time in seconds between two checks of the same file. */
+#define CHECK_INTERVAL 1
+
+static time_t
+get_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec;
+}
+
+static char *
+read_file(int fd, size_t hint)
+{
+	size_t reserved = hint + 1;
+	size_t length = 0;
+	char *data = malloc(reserved);
+	ssize_t size;
+
+	while (data) {
+		if (length + 1 == reserved)
+			data = realloc(data, reserved *= 2);
+		if (!data)
+			break;
+		size = read(fd, data + length, reserved - length - 1);
+		if (size == 0) {
+			data[length] = '\0';
+			return data;
+		}
+		if (size == -1 && errno != EINTR)
+			break;
+		if (size > 0)
+			length += size;
+	}
+
+	free(data);
+	return NULL;
+}
+
+static void
+free_file(struct netresolve_file_cache *cache, struct netresolve_file *file)
+{
+	if (cache->cleanup)
+		cache->cleanup(file);
+
+	free(file->name);
+	free(file->path);
+	free(file->data);
+	free(file);
+}
+
+static struct netresolve_file *
+load_file(struct netresolve_file_cache *cache, const char *name, const char *path)
+{
+	struct netresolve_file *file = calloc(1, cache->size);
+	struct stat st;
+	int fd;
+
+	if (!file)
+		return NULL;
+	if (!(file->name = strdup(name)) || !(file->path = strdup(path))) {
+		free_file(cache, file);
+		return NULL;
+	}
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		file->error = errno;
+	else {
+		if (fstat(fd, &st) == -1 || !(file->data = read_file(fd, st.st_size)))
+			file->error = errno ?: EIO;
+		else {
+			file->dev = st.st_dev;
+			file->ino = st.st_ino;
+			file->size = st.st_size;
+			file->mtime = st.st_mtim;
+		}
+		close(fd);
+	}
+
+	if (!cache->parse(file)) {
+		free_file(cache, file);
+		return NULL;
+	}
+
+	return file;
+}
+
+static bool
+is_current(const struct netresolve_file *file, const char *path, const struct stat *st)
+{
+	if (strcmp(file->path, path))
+		return false;
+	if (!st)
+		return file->error;
+
+	return !file->error &&
+		file->dev == st->st_dev &&
+		file->ino == st->st_ino &&
+		file->size == st->st_size &&
+		file->mtime.tv_sec == st->st_mtim.tv_sec &&
+		file->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/* acquire_file:
+ *
+ * Take a reference to the current file without locking. Readers announce
+ * themselves in `readers` while they load the pointer and take the
+ * reference, so that a replaced file isn't released before they're done.
+ */
+static struct netresolve_file *
+acquire_file(struct netresolve_file_cache *cache)
+{
+	struct netresolve_file *file;
+
+	__atomic_add_fetch(&cache->readers, 1, __ATOMIC_SEQ_CST);
+	if ((file = __atomic_load_n(&cache->current, __ATOMIC_SEQ_CST)))
+		__atomic_add_fetch(&file->refcount, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&cache->readers, 1, __ATOMIC_RELEASE);
+
+	return file;
+}
+
+/* replace_file:
+ *
+ * Make `file` current and drop the reference the cache held to the old
+ * one once no reader can still be about to take a reference to it. The
+ * window is a few instructions long and files change rarely.
+ */
+static void
+replace_file(struct netresolve_file_cache *cache, struct netresolve_file *file)
+{
+	struct netresolve_file *old = __atomic_exchange_n(&cache->current, file, __ATOMIC_SEQ_CST);
+
+	while (__atomic_load_n(&cache->readers, __ATOMIC_SEQ_CST))
+		sched_yield();
+
+	if (old)
+		netresolve_file_put(cache, old);
+}
+
+/* netresolve_file_get:
+ *
+ * Get a reference to the parsed contents of `path`, or `fallback` when
+ * `path` doesn't exist. The file is only checked for changes once per
+ * CHECK_INTERVAL and only read and parsed again when its identity, size
+ * or modification time changes. No lock is taken, the reference is an
+ * atomic counter and a reload swaps the current file.
+ */
+struct netresolve_file *
+netresolve_file_get(struct netresolve_file_cache *cache, const char *path, const char *fallback)
+{
+	const char *name = path;
+	struct netresolve_file *file;
+	time_t now = get_time();
+	struct stat st;
+	bool exists;
+
+	if ((file = acquire_file(cache)) && strcmp(file->name, name)) {
+		netresolve_file_put(cache, file);
+		file = NULL;
+	}
+
+	if (file && now - __atomic_load_n(&cache->checked, __ATOMIC_RELAXED) < CHECK_INTERVAL)
+		return file;
+
+	if (!(exists = stat(path, &st) == 0) && fallback)
+		exists = stat(path = fallback, &st) == 0;
+
+	if (file && is_current(file, path, exists ? &st : NULL)) {
+		__atomic_store_n(&cache->checked, now, __ATOMIC_RELAXED);
+		return file;
+	}
+
+	if (file)
+		netresolve_file_put(cache, file);
+
+	if (!(file = load_file(cache, name, path)))
+		return NULL;
+
+	/* One reference for the caller and one for the cache. */
+	file->refcount = 2;
+
+	__atomic_store_n(&cache->checked, now, __ATOMIC_RELAXED);
+	replace_file(cache, file);
+
+	return file;
+}
+
+void
+netresolve_file_put(struct netresolve_file_cache *cache, struct netresolve_file *file)
+{
+	if (!__atomic_sub_fetch(&file->refcount, 1, __ATOMIC_ACQ_REL))
+		free_file(cache, file);
+}
+
+/* netresolve_file_clear:
+ *
+ * Drop the reference held by the cache, to be called when the module
+ * owning the cache is unloaded.
+ */
+void
+netresolve_file_clear(struct netresolve_file_cache *cache)
+{
+	replace_file(cache, NULL);
+}
@@ -0,0 +1,228 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <netresolve-private.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* Connection history
+ *
+ * A small process-wide table remembers recent outcomes of connection
+ * attempts made by `netresolve_connect()` per destination address and per
+ * address family, together with handshake round trip times per family.
+ * New connections use it to try addresses that worked first, to put
+ * addresses that failed recently last and to adjust their delays and
+ * timeouts to the observed network.
+ */
+#define HISTORY_SIZE 128
+#define HISTORY_LIFETIME 600
+#define HISTORY_SAMPLES 32
+#define HISTORY_MIN_SAMPLES 8
+
+struct netresolve_outcome {
+	time_t success;
+	time_t failure;
+};
+
+static struct netresolve_history_entry {
+	int family;
+	struct in6_addr address;
+	struct netresolve_outcome outcome;
+	time_t used;
+} entries[HISTORY_SIZE];
+
+static struct netresolve_family_history {
+	int family;
+	struct netresolve_outcome outcome;
+	int samples[HISTORY_SAMPLES];
+	int nsamples;
+	int next;
+} families[] = {
+	{ .family = AF_INET },
+	{ .family = AF_INET6 },
+};
+
+static pthread_mutex_t history_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t
+get_time(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* Zero is reserved for unknown outcomes. */
+	return now.tv_sec + 1;
+}
+
+static struct netresolve_family_history *
+find_family(int family)
+{
+	for (int i = 0; i < sizeof families / sizeof *families; i++)
+		if (families[i].family == family)
+			return &families[i];
+
+	return NULL;
+}
+
+static size_t
+address_length(int family)
+{
+	return family == AF_INET ? sizeof (struct in_addr) : sizeof (struct in6_addr);
+}
+
+static struct netresolve_history_entry *
+find_entry(const struct netresolve_path *path, bool create)
+{
+	struct netresolve_history_entry *oldest = &entries[0];
+	size_t length = address_length(path->node.family);
+
+	for (int i = 0; i < HISTORY_SIZE; i++) {
+		struct netresolve_history_entry *entry = &entries[i];
+
+		if (entry->family == path->node.family && !memcmp(&entry->address, path->node.address, length))
+			return entry;
+		if (entry->used < oldest->used)
+			oldest = entry;
+	}
+
+	if (!create)
+		return NULL;
+
+	/* Replace the least recently used entry. */
+	memset(oldest, 0, sizeof *oldest);
+	oldest->family = path->node.family;
+	memcpy(&oldest->address, path->node.address, length);
+
+	return oldest;
+}
+
+static int
+rank_outcome(const struct netresolve_outcome *outcome, time_t now, int cooldown)
+{
+	if (outcome->failure > outcome->success && now - outcome->failure < cooldown)
+		return -1;
+	if (outcome->success > outcome->failure && now - outcome->success < HISTORY_LIFETIME)
+		return 1;
+
+	return 0;
+}
+
+static int
+compare_int(const void *p1, const void *p2)
+{
+	return *(const int *) p1 - *(const int *) p2;
+}
+
+/* netresolve_history_add:
+ *
+ * Record the outcome of a connection attempt to an IPv4 or IPv6 path. The
+ * handshake round trip time in milliseconds is only recorded when not
+ * negative.
+ */
+void
+netresolve_history_add(const struct netresolve_path *path, bool success, int rtt)
+{
+	struct netresolve_family_history *family = find_family(path->node.family);
+	struct netresolve_history_entry *entry;
+	time_t now = get_time();
+
+	if (!family)
+		return;
+
+	pthread_mutex_lock(&history_mutex);
+
+	entry = find_entry(path, true);
+	entry->used = now;
+	if (success)
+		entry->outcome.success = family->outcome.success = now;
+	else
+		entry->outcome.failure = family->outcome.failure = now;
+
+	if (success && rtt >= 0) {
+		family->samples[family->next] = rtt;
+		family->next = (family->next + 1) % HISTORY_SAMPLES;
+		if (family->nsamples < HISTORY_SAMPLES)
+			family->nsamples++;
+	}
+
+	pthread_mutex_unlock(&history_mutex);
+}
+
+/* netresolve_history_rank:
+ *
+ * Returns 1 for paths that recently accepted a connection, -1 for paths
+ * that failed within the cool-down period in seconds and 0 otherwise.
+ * Paths without own history are ranked by the history of their family.
+ */
+int
+netresolve_history_rank(const struct netresolve_path *path, int cooldown)
+{
+	struct netresolve_family_history *family = find_family(path->node.family);
+	struct netresolve_history_entry *entry;
+	time_t now = get_time();
+	int rank;
+
+	if (!family)
+		return 0;
+
+	pthread_mutex_lock(&history_mutex);
+	if ((entry = find_entry(path, false)))
+		rank = rank_outcome(&entry->outcome, now, cooldown);
+	else
+		rank = rank_outcome(&family->outcome, now, cooldown);
+	pthread_mutex_unlock(&history_mutex);
+
+	return rank;
+}
+
+/* netresolve_history_rtt:
+ *
+ * Returns the given percentile of recent handshake round trip times in
+ * milliseconds for an address family or -1 when there are not enough
+ * samples.
+ */
+int
+netresolve_history_rtt(int family, int percentile)
+{
+	struct netresolve_family_history *history = find_family(family);
+	int samples[HISTORY_SAMPLES];
+	int count;
+
+	if (!history)
+		return -1;
+
+	pthread_mutex_lock(&history_mutex);
+	count = history->nsamples;
+	memcpy(samples, history->samples, count * sizeof *samples);
+	pthread_mutex_unlock(&history_mutex);
+
+	if (count < HISTORY_MIN_SAMPLES)
+		return -1;
+
+	qsort(samples, count, sizeof *samples, compare_int);
+
+	return samples[(count - 1) * percentile / 100];
+}
@@ -0,0 +1,224 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <netresolve-pool.h>
+#include <netresolve-epoll.h>
+#include <netresolve-submit.h>
+#include <netresolve-private.h>
+#include <pthread.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <poll.h>
+
+/* Resolver pool
+ *
+ * Each worker thread runs its own epoll based context and receives queries
+ * through its submission list. Requests are assigned to workers by name,
+ * so that identical requests share the worker's cache and in-flight
+ * queries.
+ */
+struct netresolve_worker {
+	pthread_t thread;
+	netresolve_t context;
+	bool stop;
+};
+
+struct netresolve_pool {
+	struct netresolve_request request;
+	struct netresolve_worker *workers;
+	int count;
+	unsigned int next;
+};
+
+static void
+free_request(struct netresolve_request *request)
+{
+	free(request->nodename);
+	free(request->servname);
+	free(request->dns_name);
+}
+
+static void *
+run_worker(void *data)
+{
+	struct netresolve_worker *worker = data;
+	netresolve_t context = worker->context;
+	struct pollfd pfd = { .fd = netresolve_epoll_fd(context), .events = POLLIN };
+
+	while (!__atomic_load_n(&worker->stop, __ATOMIC_ACQUIRE)) {
+		if (poll(&pfd, 1, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			error("poll: %s", strerror(errno));
+			abort();
+		}
+
+		netresolve_epoll_dispatch(context);
+	}
+
+	return NULL;
+}
+
+static bool
+init_worker(struct netresolve_worker *worker)
+{
+	if (!(worker->context = netresolve_epoll_new()))
+		return false;
+
+	if (!netresolve_submit_setup(worker->context) || pthread_create(&worker->thread, NULL, run_worker, worker)) {
+		netresolve_context_free(worker->context);
+		return false;
+	}
+
+	return true;
+}
+
+/* netresolve_pool_new:
+ *
+ * Create a pool of worker threads, each of them running its own context.
+ * Use zero to get one worker per online processor.
+ */
+netresolve_pool_t
+netresolve_pool_new(int nthreads)
+{
+	netresolve_pool_t pool;
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads <= 0)
+		nthreads = 1;
+
+	if (!(pool = calloc(1, sizeof *pool)))
+		return NULL;
+	if (!(pool->workers = calloc(nthreads, sizeof *pool->workers))) {
+		free(pool);
+		return NULL;
+	}
+
+	for (pool->count = 0; pool->count < nthreads; pool->count++) {
+		if (!init_worker(&pool->workers[pool->count])) {
+			netresolve_pool_free(pool);
+			return NULL;
+		}
+	}
+
+	/* Requests are constructed using the defaults of the contexts. */
+	netresolve_request_copy(&pool->request, &pool->workers[0].context->request);
+
+	return pool;
+}
+
+/* netresolve_pool_free:
+ *
+ * Stop all worker threads. Queries that haven't been finished yet are
+ * cancelled without calling their callbacks.
+ */
+void
+netresolve_pool_free(netresolve_pool_t pool)
+{
+	for (int i = 0; i < pool->count; i++) {
+		struct netresolve_worker *worker = &pool->workers[i];
+
+		__atomic_store_n(&worker->stop, true, __ATOMIC_RELEASE);
+		netresolve_submit_wake(worker->context);
+	}
+
+	for (int i = 0; i < pool->count; i++) {
+		struct netresolve_worker *worker = &pool->workers[i];
+
+		pthread_join(worker->thread, NULL);
+		netresolve_context_free(worker->context);
+	}
+
+	free_request(&pool->request);
+	free(pool->workers);
+	free(pool);
+}
+
+static unsigned int
+hash_name(const char *name)
+{
+	unsigned int hash = 5381;
+
+	/* Names are compared case-insensitively. */
+	for (; *name; name++)
+		hash = hash * 33 + tolower((unsigned char) *name);
+
+	return hash;
+}
+
+static struct netresolve_worker *
+get_worker(netresolve_pool_t pool, const struct netresolve_request *request)
+{
+	const char *name = request->type == NETRESOLVE_REQUEST_DNS ? request->dns_name : request->nodename;
+	unsigned int index;
+
+	if (name && request->type != NETRESOLVE_REQUEST_REVERSE)
+		index = hash_name(name);
+	else
+		index = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED);
+
+	return &pool->workers[index % pool->count];
+}
+
+/* netresolve_pool_query:
+ *
+ * Submit a query to the pool from any thread, using the same options as
+ * `netresolve_query()`. The callback is called in the worker thread once
+ * the query is finished and the query is freed when the callback returns.
+ */
+bool
+netresolve_pool_query(netresolve_pool_t pool, netresolve_query_callback callback, void *user_data,
+		enum netresolve_option type, ...)
+{
+	struct netresolve_request request;
+	va_list ap;
+	bool ok;
+
+	netresolve_request_copy(&request, &pool->request);
+	request.type = type;
+
+	va_start(ap, type);
+	ok = netresolve_request_set_options_from_va(&request, ap);
+	va_end(ap);
+
+	if (ok)
+		ok = netresolve_submit_request(get_worker(pool, &request)->context, &request, callback, user_data);
+
+	free_request(&request);
+
+	return ok;
+}
+
+bool
+netresolve_pool_query_forward(netresolve_pool_t pool,
+		const char *nodename, const char *servname,
+		netresolve_query_callback callback, void *user_data)
+{
+	return netresolve_pool_query(pool, callback, user_data,
+			NETRESOLVE_REQUEST_FORWARD,
+			NETRESOLVE_OPTION_NODE_NAME, nodename,
+			NETRESOLVE_OPTION_SERVICE_NAME, servname,
+			NULL);
+}
@@ -25,7 +25,6 @@
 #include <unistd.h>
 #include <string.h>
 #include <poll.h>
-#include <sys/eventfd.h>
 
 const char *
 netresolve_query_state_to_string(enum netresolve_state state)
@@ -65,19 +64,116 @@ clear_timeout(netresolve_query_t query, netresolve_timeout_t *timeout)
 static void
 cleanup_query(netresolve_query_t query)
 {
-	struct netresolve_backend *backend = query->backend ? *query->backend : NULL;
-
-	clear_timeout(query, &query->delayed);
+	netresolve_runqueue_remove(query);
 	clear_timeout(query, &query->request_timeout);
 	clear_timeout(query, &query->result_timeout);
 
-	if (backend) {
-		if (backend->cleanup)
-			backend->cleanup(backend->data);
-		if (backend->data)
-			free(backend->data);
-		backend->data = NULL;
+	if (query->priv.data) {
+		if (query->priv.cleanup)
+			query->priv.cleanup(query->priv.data);
+		free(query->priv.data);
+	}
+	query->priv.cleanup = NULL;
+	query->priv.data = NULL;
+}
+
+/* find_leader:
+ *
+ * Find a query for the same request that is already waiting for the
+ * backends, so that the new query doesn't need to run them again.
+ */
+static netresolve_query_t
+find_leader(netresolve_query_t query)
+{
+	struct netresolve_query *queries = &query->context->queries;
+
+	for (netresolve_query_t leader = queries->next; leader != queries; leader = leader->next) {
+		if (leader == query || leader->leader || leader->parent)
+			continue;
+		if (leader->state != NETRESOLVE_STATE_WAITING && leader->state != NETRESOLVE_STATE_WAITING_MORE)
+			continue;
+		if (netresolve_request_equal(&leader->request, &query->request))
+			return leader;
+	}
+
+	return NULL;
+}
+
+static netresolve_query_t
+find_follower(netresolve_query_t query)
+{
+	struct netresolve_query *queries = &query->context->queries;
+
+	for (netresolve_query_t follower = queries->next; follower != queries; follower = follower->next)
+		if (follower->leader == query)
+			return follower;
+
+	return NULL;
+}
+
+/* finish_followers:
+ *
+ * Hand over the final response of a leader query to all queries attached
+ * to it. The list is rescanned after each callback as the callbacks are
+ * free to create or destroy queries. A leader freed by one of them is only
+ * destroyed once all of them are finished. Returns false when the leader
+ * has been freed.
+ */
+static bool
+finish_followers(netresolve_query_t query)
+{
+	bool dispatching = query->dispatching;
+	netresolve_query_t follower;
+
+	query->dispatching = true;
+	while ((follower = find_follower(query))) {
+		follower->leader = NULL;
+		netresolve_response_copy(&follower->response, &query->response);
+		/* Paths of a leader reporting them one by one are not sorted. */
+		if (query->request.path_callback) {
+			netresolve_backend_sort_paths(&follower->response);
+			netresolve_backend_order_by_weight(follower);
+		}
+		/* The leader has already stored the response in the cache. */
+		follower->cached = true;
+		netresolve_query_set_state(follower, query->state);
 	}
+	query->dispatching = dispatching;
+
+	if (!query->freed)
+		return true;
+
+	/* A query being dispatched is destroyed by the dispatcher. */
+	if (!dispatching)
+		netresolve_query_free(query);
+
+	return false;
+}
+
+/* promote_follower:
+ *
+ * A leader query is being destroyed before finishing. Let the first of its
+ * followers run the backends instead and attach the others to it.
+ */
+static void
+promote_follower(netresolve_query_t query)
+{
+	struct netresolve_query *queries = &query->context->queries;
+	netresolve_query_t leader = find_follower(query);
+
+	if (!leader)
+		return;
+
+	debug_query(leader, "taking over the request from query %p", query);
+
+	leader->leader = NULL;
+	for (netresolve_query_t follower = queries->next; follower != queries; follower = follower->next)
+		if (follower->leader == query)
+			follower->leader = leader;
+
+	clear_timeout(leader, &leader->request_timeout);
+	leader->backend = leader->backends;
+	netresolve_query_set_state(leader, NETRESOLVE_STATE_SETUP);
 }
 
 static void
@@ -109,14 +205,159 @@ dispatch_result_timeout(netresolve_query_t query, netresolve_timeout_t timeout,
 	dispatch_timeout(query, &query->result_timeout, NETRESOLVE_STATE_DONE);
 }
 
+/* Backend group race
+ *
+ * A group of backends is run by starting one internal query per member.
+ * The first member query that finishes adds its results to the response,
+ * the others are cancelled together with the private data of the racing
+ * query.
+ */
+struct netresolve_race {
+	netresolve_query_t *racers;
+	int count;
+	int pending;
+};
+
+static netresolve_query_t
+alloc_query(netresolve_t context)
+{
+	struct netresolve_query *queries = &context->queries;
+	netresolve_query_t query;
+
+	if (!(query = calloc(1, sizeof *query)))
+		return NULL;
+
+	query->previous = queries->previous;
+	query->next = queries;
+	query->previous->next = query->next->previous = query;
+
+	query->context = context;
+	query->watches.previous = query->watches.next = &query->watches;
+
+	return query;
+}
+
+static void
+cleanup_race(void *data)
+{
+	struct netresolve_race *race = data;
+
+	for (int i = 0; i < race->count; i++)
+		if (race->racers[i])
+			netresolve_query_free(race->racers[i]);
+	free(race->racers);
+}
+
 static void
-dispatch_delayed(netresolve_query_t query, netresolve_timeout_t timeout, void *data)
+start_race(netresolve_query_t query, struct netresolve_backend *backend)
+{
+	struct netresolve_race *race;
+
+	if (!(race = netresolve_backend_new_priv(query, sizeof *race, cleanup_race)))
+		return;
+
+	while (backend->group[race->count])
+		race->count++;
+	if (!(race->racers = calloc(race->count, sizeof *race->racers))) {
+		race->count = 0;
+		netresolve_backend_failed(query);
+		return;
+	}
+
+	for (int i = 0; i < race->count; i++) {
+		netresolve_query_t racer = alloc_query(query->context);
+
+		if (!racer)
+			continue;
+
+		racer->parent = query;
+		racer->backend = &backend->group[i];
+		netresolve_request_copy(&racer->request, &query->request);
+		racer->request.path_callback = NULL;
+		race->racers[i] = racer;
+		race->pending++;
+
+		debug_query(racer, "racing for query %p", query);
+	}
+
+	/* Racers may fail immediately, all of them need to be counted first. */
+	for (int i = 0; i < race->count; i++)
+		if (race->racers[i])
+			netresolve_query_set_state(race->racers[i], NETRESOLVE_STATE_SETUP);
+
+	if (!race->pending && query->state == NETRESOLVE_STATE_SETUP)
+		netresolve_backend_failed(query);
+}
+
+static void
+finish_racer(netresolve_query_t racer)
+{
+	netresolve_query_t query = racer->parent;
+	struct netresolve_race *race = query->priv.data;
+
+	if (query->state != NETRESOLVE_STATE_SETUP && query->state != NETRESOLVE_STATE_WAITING)
+		return;
+
+	race->pending--;
+
+	if (racer->state == NETRESOLVE_STATE_DONE) {
+		debug_query(query, "race won by query %p", racer);
+		/* Earlier backends may have contributed to the response. */
+		netresolve_backend_add_response(query, &racer->response);
+		/* Enough paths may have finished the query already. */
+		if (query->state == NETRESOLVE_STATE_SETUP || query->state == NETRESOLVE_STATE_WAITING
+				|| query->state == NETRESOLVE_STATE_WAITING_MORE)
+			netresolve_backend_finished(query);
+	} else if (!race->pending)
+		netresolve_backend_failed(query);
+}
+
+/* netresolve_query_has_enough_paths:
+ *
+ * Check whether the query has the number of usable paths requested using
+ * `NETRESOLVE_OPTION_MAX_PATHS`. Paths to unreachable IP destinations
+ * don't count.
+ */
+bool
+netresolve_query_has_enough_paths(netresolve_query_t query)
+{
+	struct netresolve_response *response = &query->response;
+	int count = 0;
+
+	if (query->request.max_paths <= 0)
+		return false;
+
+	for (size_t i = 0; i < response->pathcount; i++) {
+		struct netresolve_path *path = &response->paths[i];
+
+		if (path->node.reachable || (path->node.family != AF_INET && path->node.family != AF_INET6))
+			count++;
+	}
+
+	return count >= query->request.max_paths;
+}
+
+/* report_paths:
+ *
+ * Hand the paths added since the last call over to the path callback. Like
+ * a watch callback, the path callback may free the query, which is then
+ * left to the caller. Returns false in that case.
+ */
+static bool
+report_paths(netresolve_query_t query)
 {
-	assert(query->state == NETRESOLVE_STATE_RESOLVED);
+	netresolve_path_callback callback = query->request.path_callback;
+	bool dispatching = query->dispatching;
+
+	if (!callback)
+		return true;
 
-	debug_query(query, "delayed state change triggered");
+	query->dispatching = true;
+	while (!query->freed && query->reported < query->response.pathcount)
+		callback(query, query->reported++, query->request.path_user_data);
+	query->dispatching = dispatching;
 
-	dispatch_timeout(query, &query->delayed, NETRESOLVE_STATE_DONE);
+	return !query->freed;
 }
 
 void
@@ -136,23 +377,26 @@ netresolve_query_set_state(netresolve_query_t query, enum netresolve_state state
 	switch (state) {
 	case NETRESOLVE_STATE_NONE:
 		free(query->request.dns_name);
+		query->request.dns_name = NULL;
 		free(query->response.paths);
 		free(query->response.nodename);
 		free(query->response.servname);
-		netresolve_service_list_free(query->services);
+		free(query->response.dns.answer);
 		memset(&query->response, 0, sizeof query->response);
+		query->reported = 0;
 		break;
 	case NETRESOLVE_STATE_SETUP:
 		{
 			struct netresolve_backend *backend = *query->backend;
 			void (*setup)(netresolve_query_t query, char **settings);
 
-			if (query->request.dns_srv_lookup && !query->request.protocol)
-				query->request.protocol = IPPROTO_TCP;
-
+			netresolve_backend_load(backend);
 			setup = backend->setup[query->request.type];
-			if (setup) {
-				setup(query, backend->settings + 1);
+			if (backend->group || setup) {
+				if (backend->group)
+					start_race(query, backend);
+				else
+					setup(query, backend->settings + 1);
 				if (query->state == NETRESOLVE_STATE_SETUP)
 					netresolve_query_set_state(query, query->request.request_timeout ? NETRESOLVE_STATE_WAITING : NETRESOLVE_STATE_FAILED);
 				if (query->state == NETRESOLVE_STATE_ERROR)
@@ -172,33 +416,51 @@ netresolve_query_set_state(netresolve_query_t query, enum netresolve_state state
 			query->result_timeout = netresolve_timeout_add_ms(query, query->request.result_timeout, dispatch_result_timeout, NULL);
 		break;
 	case NETRESOLVE_STATE_RESOLVED:
-		if (old_state == NETRESOLVE_STATE_SETUP) {
-			int fd;
-
-			if ((fd = eventfd(1, EFD_NONBLOCK)) == -1) {
-				error("can't create eventfd");
-				abort();
-			}
-			/* FIXME: should also work with zero! */
-			/* FIXME: might not even be needed any more! */
-			query->delayed = netresolve_timeout_add_ms(query, 0, dispatch_delayed, NULL);
-		}
+		/* Backends sharing resources between queries may finish a query
+		 * while dispatching another one.
+		 */
+		if (old_state == NETRESOLVE_STATE_SETUP || old_state == NETRESOLVE_STATE_NONE || !query->dispatching)
+			netresolve_runqueue_add(query);
 		break;
 	case NETRESOLVE_STATE_DONE:
+		/* Backends may finish the query right after adding a path while
+		 * it is being dispatched.
+		 */
+		if (query->dispatching)
+			report_paths(query);
+
 		cleanup_query(query);
 
-		/* Restart with the next *mandatory* backend. */
-		while (*++query->backend) {
+		if (query->parent) {
+			finish_racer(query);
+			break;
+		}
+
+		/* Restart with the next *mandatory* backend unless the query
+		 * already has all the paths it asked for.
+		 */
+		if (netresolve_query_has_enough_paths(query))
+			while (*query->backend)
+				query->backend++;
+		while (*query->backend && *++query->backend) {
 			if ((*query->backend)->mandatory) {
 				netresolve_query_set_state(query, NETRESOLVE_STATE_SETUP);
 				break;
 			}
 		}
 
-		if (query->callback)
+		if (!*query->backend) {
+			netresolve_cache_store(query);
+			if (!finish_followers(query))
+				break;
+		}
+
+		if (query->callback && !query->freed)
 			query->callback(query, query->user_data);
 		break;
 	case NETRESOLVE_STATE_ERROR:
+		if (old_state != NETRESOLVE_STATE_SETUP && !query->dispatching)
+			netresolve_runqueue_add(query);
 		break;
 	case NETRESOLVE_STATE_FAILED:
 		if (query->response.pathcount)
@@ -206,13 +468,22 @@ netresolve_query_set_state(netresolve_query_t query, enum netresolve_state state
 
 		cleanup_query(query);
 
+		if (query->parent) {
+			finish_racer(query);
+			break;
+		}
+
 		/* Restart with the next backend. */
-		if (*++query->backend) {
+		if (*query->backend && *++query->backend) {
 			netresolve_query_set_state(query, NETRESOLVE_STATE_SETUP);
 			break;
 		}
 
-		if (query->callback)
+		query->leader = NULL;
+		if (!finish_followers(query))
+			break;
+
+		if (query->callback && !query->freed)
 			query->callback(query, query->user_data);
 		break;
 	}
@@ -221,25 +492,17 @@ netresolve_query_set_state(netresolve_query_t query, enum netresolve_state state
 netresolve_query_t
 netresolve_query_new(netresolve_t context, enum netresolve_request_type type)
 {
-	struct netresolve_query *queries = &context->queries;
 	netresolve_query_t query;
 
-	if (!(query = calloc(1, sizeof *query)))
+	if (!(query = alloc_query(context)))
 		return NULL;
 
-	query->previous = queries->previous;
-	query->next = queries;
-	query->previous->next = query->next->previous = query;
-
-	query->context = context;
-	query->watches.previous = query->watches.next = &query->watches;
-
 	if (!context->backends)
 		netresolve_set_backend_string(context, secure_getenv("NETRESOLVE_BACKENDS"));
 	if (!context->backends || !*context->backends)
 		abort();
 
-	query->backend = context->backends;
+	query->backend = query->backends = context->backends;
 	memcpy(&query->request, &context->request, sizeof context->request);
 
 	query->request.type = type;
@@ -249,20 +512,71 @@ netresolve_query_new(netresolve_t context, enum netresolve_request_type type)
 	return query;
 }
 
+/* netresolve_query_start:
+ *
+ * This internal function starts resolving a query created using
+ * `netresolve_query_new()` once its request has been filled in. It doesn't
+ * wait for the query in blocking mode.
+ */
+void
+netresolve_query_start(netresolve_query_t query)
+{
+	netresolve_t context = query->context;
+
+	if (context->config.force_family)
+		query->request.family = context->config.force_family;
+	/* Normalize the request before it is compared to cached and in-flight
+	 * ones.
+	 */
+	if (query->request.dns_srv_lookup && !query->request.protocol)
+		query->request.protocol = IPPROTO_TCP;
+
+	query->backend = query->backends = netresolve_route_backends(context, &query->request);
+
+	if (netresolve_fastpath(query) || netresolve_cache_lookup(query)) {
+		query->reported = query->response.pathcount;
+
+		/* Callbacks like the socket API ones may need the event loop. */
+		if (!context->callbacks.add_watch && query->callback)
+			netresolve_epoll_install(context, &context->epoll, true);
+
+		/* Responses available right away are served directly in blocking mode. */
+		if (!context->callbacks.add_watch || context->callbacks.user_data == &context->epoll) {
+			netresolve_query_set_state(query, NETRESOLVE_STATE_DONE);
+			return;
+		}
+
+		netresolve_query_set_state(query, NETRESOLVE_STATE_RESOLVED);
+		return;
+	}
+
+	/* Install default callbacks for first query in blocking mode. */
+	if (!context->callbacks.add_watch)
+		netresolve_epoll_install(context, &context->epoll, true);
+
+	/* Attach to an identical query in progress instead of running the
+	 * backends again. The query still honors its own request timeout.
+	 * Queries reporting paths as they come run their own backends.
+	 */
+	if (!query->request.path_callback && (query->leader = find_leader(query))) {
+		debug_query(query, "attaching to query %p", query->leader);
+		while (*query->backend)
+			query->backend++;
+		netresolve_query_set_state(query, NETRESOLVE_STATE_WAITING);
+	} else
+		netresolve_query_set_state(query, NETRESOLVE_STATE_SETUP);
+}
+
 netresolve_query_t
 netresolve_query( netresolve_t context, netresolve_query_callback callback, void *user_data,
 		enum netresolve_option type, ...)
 {
-	static netresolve_t default_context = NULL;
 	netresolve_query_t query;
 	va_list ap;
 
-	/* Use a static context if none is provided. */
-	if (!context) {
-		if (!default_context)
-			default_context = netresolve_context_new();
-		context = default_context;
-	}
+	/* Use a per-thread context if none is provided. */
+	if (!context)
+		context = netresolve_context_get_default();
 	if (!context)
 		return NULL;
 
@@ -280,14 +594,7 @@ netresolve_query( netresolve_t context, netresolve_query_callback callback, void
 	}
 	va_end(ap);
 
-	if (context->config.force_family)
-		query->request.family = context->config.force_family;
-
-	/* Install default callbacks for first query in blocking mode. */
-	if (!context->callbacks.add_watch)
-		netresolve_epoll_install(context, &context->epoll, true);
-
-	netresolve_query_set_state(query, NETRESOLVE_STATE_SETUP);
+	netresolve_query_start(query);
 
 	/* Wait for the context in blocking mode. */
 	if (context->callbacks.user_data == &context->epoll)
@@ -360,12 +667,43 @@ netresolve_query_dispatch(netresolve_query_t query, netresolve_watch_t watch, in
 
 	debug_query(query, "dispatching watch %p", watch);
 
+	query->dispatching = true;
 	watch->callback(query, watch, fd, events, data);
+	query->dispatching = false;
 
-	/* Check for state changes. */
+	if (query->freed || !report_paths(query)) {
+		netresolve_query_free(query);
+		return;
+	}
+
+	/* Check for state changes. The callback of a finished query may
+	 * free it, so only one transition is performed.
+	 */
 	if (query->state == NETRESOLVE_STATE_RESOLVED)
 		netresolve_query_set_state(query, NETRESOLVE_STATE_DONE);
-	if (query->state == NETRESOLVE_STATE_ERROR)
+	else if (query->state == NETRESOLVE_STATE_ERROR)
+		netresolve_query_set_state(query, NETRESOLVE_STATE_FAILED);
+}
+
+/* netresolve_query_dispatch_deferred:
+ *
+ * This internal function is called from the context run queue to perform
+ * a state change deferred to the next main loop iteration.
+ */
+void
+netresolve_query_dispatch_deferred(netresolve_query_t query)
+{
+	debug_query(query, "deferred state change triggered");
+
+	if (!report_paths(query)) {
+		netresolve_query_free(query);
+		return;
+	}
+
+	/* The query may be freed by its callback. */
+	if (query->state == NETRESOLVE_STATE_RESOLVED)
+		netresolve_query_set_state(query, NETRESOLVE_STATE_DONE);
+	else if (query->state == NETRESOLVE_STATE_ERROR)
 		netresolve_query_set_state(query, NETRESOLVE_STATE_FAILED);
 }
 
@@ -379,10 +717,20 @@ netresolve_query_dispatch(netresolve_query_t query, netresolve_watch_t watch, in
 void
 netresolve_query_free(netresolve_query_t query)
 {
+	/* The query is being used by `netresolve_query_dispatch()`. */
+	if (query->dispatching) {
+		query->freed = true;
+		return;
+	}
+
 	debug_query(query, "destroying query");
 
 	cleanup_query(query);
 
+	if (!query->leader && (query->state == NETRESOLVE_STATE_WAITING || query->state == NETRESOLVE_STATE_WAITING_MORE))
+		promote_follower(query);
+	query->leader = NULL;
+
 	netresolve_query_set_state(query, NETRESOLVE_STATE_NONE);
 
 	assert(query->nfds == 0);
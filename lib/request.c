@@ -88,6 +88,25 @@ netresolve_request_set_options_from_va(struct netresolve_request *request, va_li
 		case NETRESOLVE_OPTION_DNS_SRV_LOOKUP:
 			request->dns_srv_lookup = va_arg(ap, int);
 			break;
+		case NETRESOLVE_OPTION_PATH_CALLBACK:
+			request->path_callback = va_arg(ap, netresolve_path_callback);
+			request->path_user_data = va_arg(ap, void *);
+			break;
+		case NETRESOLVE_OPTION_MAX_PATHS:
+			request->max_paths = va_arg(ap, int);
+			break;
+		case NETRESOLVE_OPTION_CONNECT_WINDOW:
+			request->connect_window = va_arg(ap, int);
+			break;
+		case NETRESOLVE_OPTION_TCP_FASTOPEN:
+			request->tcp_fastopen = va_arg(ap, int);
+			break;
+		case NETRESOLVE_OPTION_REUSE_PORT:
+			request->reuse_port = va_arg(ap, int);
+			break;
+		case NETRESOLVE_OPTION_DEFER_ACCEPT:
+			request->defer_accept = va_arg(ap, int);
+			break;
 		default:
 			return false;
 		}
@@ -106,6 +125,21 @@ get_option(struct netresolve_request *request, int option, void *argument)
 	case NETRESOLVE_OPTION_DNS_SRV_LOOKUP:
 		*(bool *) argument = request->dns_srv_lookup;
 		break;
+	case NETRESOLVE_OPTION_MAX_PATHS:
+		*(int *) argument = request->max_paths;
+		break;
+	case NETRESOLVE_OPTION_CONNECT_WINDOW:
+		*(int *) argument = request->connect_window;
+		break;
+	case NETRESOLVE_OPTION_TCP_FASTOPEN:
+		*(bool *) argument = request->tcp_fastopen;
+		break;
+	case NETRESOLVE_OPTION_REUSE_PORT:
+		*(bool *) argument = request->reuse_port;
+		break;
+	case NETRESOLVE_OPTION_DEFER_ACCEPT:
+		*(int *) argument = request->defer_accept;
+		break;
 	case NETRESOLVE_OPTION_NODE_NAME:
 		*(const char **) argument = request->nodename;
 		break;
@@ -158,3 +192,87 @@ netresolve_request_get_options_from_va(struct netresolve_request *request, va_li
 
 	return true;
 }
+
+static bool
+string_equal(const char *s1, const char *s2)
+{
+	if (!s1 || !s2)
+		return s1 == s2;
+
+	return !strcmp(s1, s2);
+}
+
+static bool
+name_equal(const char *s1, const char *s2)
+{
+	if (!s1 || !s2)
+		return s1 == s2;
+
+	return !strcasecmp(s1, s2);
+}
+
+static size_t
+family_to_length(int family)
+{
+	switch (family) {
+	case AF_INET:
+		return sizeof (struct in_addr);
+	case AF_INET6:
+		return sizeof (struct in6_addr);
+	default:
+		return 0;
+	}
+}
+
+/* netresolve_request_copy:
+ *
+ * Deep copy of a request including the strings it owns.
+ */
+void
+netresolve_request_copy(struct netresolve_request *target, const struct netresolve_request *source)
+{
+	memcpy(target, source, sizeof *target);
+
+	target->nodename = source->nodename ? strdup(source->nodename) : NULL;
+	target->servname = source->servname ? strdup(source->servname) : NULL;
+	target->dns_name = source->dns_name ? strdup(source->dns_name) : NULL;
+}
+
+/* netresolve_request_equal:
+ *
+ * Check whether two requests would be answered the same way by the same
+ * backend chain. Only the parameters relevant to the request type are
+ * compared. Node names are compared case-insensitively.
+ */
+bool
+netresolve_request_equal(const struct netresolve_request *request1, const struct netresolve_request *request2)
+{
+	if (request1->type != request2->type)
+		return false;
+	if (request1->family != request2->family)
+		return false;
+	if (request1->socktype != request2->socktype)
+		return false;
+	if (request1->protocol != request2->protocol)
+		return false;
+
+	switch (request1->type) {
+	case NETRESOLVE_REQUEST_FORWARD:
+		return name_equal(request1->nodename, request2->nodename)
+			&& string_equal(request1->servname, request2->servname)
+			&& request1->default_loopback == request2->default_loopback
+			&& request1->dns_srv_lookup == request2->dns_srv_lookup
+			&& request1->dns_search == request2->dns_search
+			&& request1->max_paths == request2->max_paths;
+	case NETRESOLVE_REQUEST_REVERSE:
+		return !memcmp(request1->address, request2->address, family_to_length(request1->family))
+			&& request1->ifindex == request2->ifindex
+			&& request1->port == request2->port;
+	case NETRESOLVE_REQUEST_DNS:
+		return name_equal(request1->dns_name, request2->dns_name)
+			&& request1->dns_class == request2->dns_class
+			&& request1->dns_type == request2->dns_type;
+	default:
+		return false;
+	}
+}
@@ -23,8 +23,6 @@
  */
 #include <netresolve-private.h>
 #include <string.h>
-#include <unistd.h>
-#include <fcntl.h>
 #include <arpa/inet.h>
 
 struct netresolve_protocol {
@@ -51,14 +49,25 @@ static const struct netresolve_protocol protocols[] = {
 struct netresolve_service {
 	int protocol;
 	int port;
-	char *name;
+	const char *name;
+	struct netresolve_service *name_next;
+	struct netresolve_service *port_next;
 };
 
+/* struct netresolve_service_list:
+ *
+ * Parsed services database shared by all queries and threads in the
+ * process. Services are hashed by name and by port and each hash chain
+ * keeps the order of the file.
+ */
 struct netresolve_service_list {
+	struct netresolve_file file;
 	struct netresolve_service *items;
 	size_t count;
 	size_t reserved;
-
+	size_t mask;
+	struct netresolve_service **names;
+	struct netresolve_service **ports;
 };
 
 static int
@@ -74,38 +83,51 @@ protocol_from_string(const char *str)
 	return 0;
 }
 
+static size_t
+hash_name(const char *name)
+{
+	size_t hash = 2166136261u;
+
+	for (; *name; name++)
+		hash = (hash ^ (unsigned char) *name) * 16777619u;
+
+	return hash;
+}
+
+static size_t
+hash_port(int port)
+{
+	return port * 2654435761u;
+}
+
 static void
 add_service(struct netresolve_service_list *services, int protocol, int port, const char *name)
 {
-	struct netresolve_service service;
-
-	memset(&service, 0, sizeof service);
-	service.protocol = protocol;
-	service.port = port;
-	if (name)
-		service.name = strdup(name);
+	struct netresolve_service *service;
 
 	if (services->count == services->reserved) {
-		if (!services->reserved)
-			services->reserved = 256;
-		else
-			services->reserved *= 2;
-		services->items = realloc(services->items, services->reserved * sizeof service);
+		services->reserved = services->reserved ? 2 * services->reserved : 256;
+		if (!(services->items = realloc(services->items, services->reserved * sizeof *services->items)))
+			abort();
 	}
 
-	memcpy(&services->items[services->count++], &service, sizeof service);
+	service = &services->items[services->count++];
+	memset(service, 0, sizeof *service);
+	service->protocol = protocol;
+	service->port = port;
+	service->name = name;
 }
 
 static void
 read_service(struct netresolve_service_list *services, char *line)
 {
 	int protocol, port;
-	const char *name, *alias;
+	const char *name, *alias, *number;
 	char *saveptr;
 
 	if (!(name = strtok_r(line, " \t", &saveptr)))
 		return;
-	if (!(port = strtol(strtok_r(NULL, "/", &saveptr), NULL, 10)))
+	if (!(number = strtok_r(NULL, "/", &saveptr)) || !(port = strtol(number, NULL, 10)))
 		return;
 	if (!(protocol = protocol_from_string(strtok_r(NULL, " \t", &saveptr))))
 		return;
@@ -114,88 +136,105 @@ read_service(struct netresolve_service_list *services, char *line)
 		add_service(services, protocol, port, alias);
 }
 
-#define SIZE 1024
-
 static void
-read_services(struct netresolve_service_list *services, const char *path)
+read_services(struct netresolve_service_list *services)
 {
-	int fd;
-	char buffer[SIZE];
-	char *current = buffer;
-	char *end = buffer + sizeof buffer;
-	char *new;
-	size_t size;
-
-	if (path) {
-		if ((fd = open(path, O_RDONLY)) == -1)
-			return;
-	} else {
-		if ((fd = open("/etc/netresolve/services", O_RDONLY)) == -1 && (fd = open("/etc/services", O_RDONLY)) == -1)
-			return;
+	char *line = services->file.data;
+	char *end;
+
+	if (!line)
+		return;
+
+	for (; *line; line = end) {
+		if ((end = strchr(line, '\n')))
+			*end++ = '\0';
+		else
+			end = line + strlen(line);
+		/* Comment */
+		line[strcspn(line, "#")] = '\0';
+		read_service(services, line);
 	}
+}
 
-	while (true) {
-		if (current == end)
-			goto out;
-
-		size = read(fd, current, end-current);
-
-		if (size == 0)
-			goto out;
-		if (size == -1)
-			goto out;
-
-		current += size;
-
-		/* buffer ...record... new ...next... current ...empty... end */
-		for (new = buffer; new < current; new++) {
-			/* Comment */
-			if (*new == '#')
-				*new = '\0';
-			/* New line */
-			if (*new == '\n') {
-				*new++ = '\0';
-				read_service(services, buffer);
-				memmove(buffer, new, current - new);
-				current = buffer + (current - new);
-				new = buffer - 1;
-			}
-		}
+/* Chains are built backwards to keep the order of the file. */
+static bool
+build_hash(struct netresolve_service_list *services)
+{
+	size_t size = 16;
+
+	while (size < services->count)
+		size *= 2;
+
+	services->mask = size - 1;
+	services->names = calloc(size, sizeof *services->names);
+	services->ports = calloc(size, sizeof *services->ports);
+	if (!services->names || !services->ports)
+		return false;
+
+	for (size_t i = services->count; i--;) {
+		struct netresolve_service *service = &services->items[i];
+		struct netresolve_service **name_bucket = &services->names[hash_name(service->name) & services->mask];
+		struct netresolve_service **port_bucket = &services->ports[hash_port(service->port) & services->mask];
+
+		service->name_next = *name_bucket;
+		*name_bucket = service;
+		service->port_next = *port_bucket;
+		*port_bucket = service;
 	}
-out:
-	close(fd);
-	add_service(services, 0, 0, NULL);
-	services->reserved = services->count;
-	services->items = realloc(services->items, services->reserved * sizeof *services->items);
+
+	return true;
 }
 
-struct netresolve_service_list *
-netresolve_service_list_new(const char *path)
+static bool
+parse_services(struct netresolve_file *file)
 {
-	struct netresolve_service_list *services;
+	struct netresolve_service_list *services = (void *) file;
 
-	if (!path)
-		path = secure_getenv("NETRESOLVE_SERVICES");
+	read_services(services);
+	if (!build_hash(services))
+		return false;
 
-	if (!(services = calloc(1, sizeof *services)))
-		return NULL;
+	debug("services: indexed %zu items from '%s'", services->count, file->path);
 
-	read_services(services, path);
+	return true;
+}
 
-	return services;
+static void
+cleanup_services(struct netresolve_file *file)
+{
+	struct netresolve_service_list *services = (void *) file;
+
+	free(services->items);
+	free(services->names);
+	free(services->ports);
 }
 
-void
-netresolve_service_list_free(struct netresolve_service_list *services)
+static struct netresolve_file_cache services_cache = {
+	.size = sizeof (struct netresolve_service_list),
+	.parse = parse_services,
+	.cleanup = cleanup_services,
+};
+
+/* get_services:
+ *
+ * Get a reference to the services database. NETRESOLVE_SERVICES overrides
+ * the default of /etc/netresolve/services falling back to /etc/services.
+ */
+static struct netresolve_service_list *
+get_services(void)
 {
-	if (!services)
-		return;
+	const char *path = secure_getenv("NETRESOLVE_SERVICES");
 
-	for (struct netresolve_service *item = services->items; item->name; item++)
-		free(item->name);
+	if (path)
+		return (void *) netresolve_file_get(&services_cache, path, NULL);
+	return (void *) netresolve_file_get(&services_cache, "/etc/netresolve/services", "/etc/services");
+}
 
-	free(services->items);
-	free(services);
+__attribute__((destructor))
+static void
+free_current(void)
+{
+	netresolve_file_clear(&services_cache);
 }
 
 static void
@@ -216,10 +255,10 @@ found_port(const char *name, int socktype, int proto, int port,
 }
 
 void
-netresolve_service_list_query(struct netresolve_service_list **services,
-		const char *name, int socktype, int protocol, int port,
+netresolve_service_list_query(const char *name, int socktype, int protocol, int port,
 		netresolve_service_callback callback, void *user_data)
 {
+	struct netresolve_service_list *services;
 	const struct netresolve_service *service;
 	int count = 0;
 
@@ -233,10 +272,13 @@ netresolve_service_list_query(struct netresolve_service_list **services,
 		}
 	}
 
-	*services = netresolve_service_list_new(NULL);
+	if ((name || port) && (services = get_services())) {
+		if (name)
+			service = services->names[hash_name(name) & services->mask];
+		else
+			service = services->ports[hash_port(port) & services->mask];
 
-	if (*services && (*services)->items) {
-		for (service = (*services)->items; service->name; service++) {
+		for (; service; service = name ? service->name_next : service->port_next) {
 			if (name && strcmp(name, service->name))
 				continue;
 			if (protocol && protocol != service->protocol)
@@ -246,6 +288,8 @@ netresolve_service_list_query(struct netresolve_service_list **services,
 			count++;
 			found_port(service->name, socktype, service->protocol, service->port, callback, user_data);
 		}
+
+		netresolve_file_put(&services_cache, &services->file);
 	}
 
 	if (!count) {
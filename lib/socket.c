@@ -22,6 +22,8 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 #include <unistd.h>
+#include <netinet/tcp.h>
+#include <time.h>
 
 #include "netresolve-private.h"
 
@@ -30,23 +32,76 @@ struct netresolve_socket {
 	netresolve_socket_callback_t callback;
 	void *user_data;
 	int flags;
+	/* Paths with initialized socket data. */
+	size_t npaths;
+	int last_family;
+	bool started;
+	bool delayed;
+	bool resolved;
+	bool paused;
+	/* Some of the addresses come with SRV weights. */
+	bool weighted;
+	/* Call back with a negative socket when all attempts failed. */
+	bool report_failure;
+	/* Listening sockets are freed after accepting finishes. */
+	bool accepting;
+	bool freed;
+	/* Nesting level of connection code that may call back the application,
+	 * a connection request freed from a callback is only released when the
+	 * outermost one returns.
+	 */
+	int depth;
 	netresolve_timeout_t timeout;
-	netresolve_timeout_t priority_timeout;
-	bool skip_scheduled;
-	bool sequential_connect;
+	netresolve_timeout_t resolution_delay;
+	netresolve_timeout_t attempt_delay;
 };
 
+static void
+clear_timeout(struct netresolve_socket *priv, netresolve_timeout_t *timeout)
+{
+	if (!*timeout)
+		return;
+
+	netresolve_timeout_remove(priv->query, *timeout);
+	*timeout = NULL;
+}
+
 static void
 clear_timeouts(struct netresolve_socket *priv)
 {
-	if (priv->timeout) {
-		netresolve_timeout_remove(priv->query, priv->timeout);
-		priv->timeout = NULL;
-	}
-	if (priv->priority_timeout) {
-		netresolve_timeout_remove(priv->query, priv->priority_timeout);
-		priv->priority_timeout = NULL;
-	}
+	clear_timeout(priv, &priv->timeout);
+	clear_timeout(priv, &priv->resolution_delay);
+	clear_timeout(priv, &priv->attempt_delay);
+}
+
+static void
+socket_enter(struct netresolve_socket *priv)
+{
+	priv->depth++;
+}
+
+static void
+socket_leave(struct netresolve_socket *priv)
+{
+	if (!--priv->depth && priv->freed)
+		free(priv);
+}
+
+/* find_path:
+ *
+ * Socket watches refer to paths by file descriptor as the array of paths
+ * may be reallocated while more paths are added to a running query.
+ */
+static struct netresolve_path *
+find_path(netresolve_query_t query, int fd)
+{
+	struct netresolve_path *paths = query->response.paths;
+
+	for (struct netresolve_path *path = paths; path->node.family; path++)
+		if (path->socket.state == SOCKET_STATE_SCHEDULED && path->socket.fd == fd)
+			return path;
+
+	abort();
 }
 
 static void
@@ -55,7 +110,7 @@ socket_schedule(struct netresolve_socket *priv, struct netresolve_path *path, in
 	assert(path->socket.state == SOCKET_STATE_NONE);
 
 	path->socket.state = SOCKET_STATE_SCHEDULED;
-	path->socket.watch = netresolve_watch_add(priv->query, path->socket.fd, events, callback, path);
+	path->socket.watch = netresolve_watch_add(priv->query, path->socket.fd, events, callback, NULL);
 }
 
 static void
@@ -76,7 +131,7 @@ socket_resume(struct netresolve_socket *priv, struct netresolve_path *path, int
 	assert(path->socket.state == SOCKET_STATE_SCHEDULED);
 	assert(!path->socket.watch);
 
-	path->socket.watch = netresolve_watch_add(priv->query, path->socket.fd, events, callback, path);
+	path->socket.watch = netresolve_watch_add(priv->query, path->socket.fd, events, callback, NULL);
 }
 
 static void
@@ -94,9 +149,19 @@ socket_cleanup(struct netresolve_socket *priv, struct netresolve_path *path)
 }
 
 static void pickup_connected_socket(struct netresolve_socket *priv);
-static void enable_sockets(struct netresolve_socket *priv);
+static void connect_next_attempt(struct netresolve_socket *priv);
 static void connect_ready(netresolve_query_t query, netresolve_watch_t watch, int fd, int events, void *data);
 
+static int
+get_rtt(struct netresolve_path *path)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - path->socket.started.tv_sec) * 1000 + (now.tv_nsec - path->socket.started.tv_nsec) / 1000000;
+}
+
 static void
 connect_check(struct netresolve_socket *priv, struct netresolve_path *path)
 {
@@ -110,13 +175,20 @@ connect_check(struct netresolve_socket *priv, struct netresolve_path *path)
 		return;
 	case 0:
 		debug_query(priv->query, "socket: connection %d via %s succeeded", idx, family);
-		if (path->socket.state == SOCKET_STATE_SCHEDULED)
+		/* Immediate connections don't measure the handshake. */
+		if (path->socket.state == SOCKET_STATE_SCHEDULED) {
+			netresolve_history_add(path, true, get_rtt(path));
 			socket_pause(priv, path);
+		} else
+			netresolve_history_add(path, true, -1);
 		path->socket.state = SOCKET_STATE_READY;
 		break;
 	default:
 		error("socket: connection %d via %s failed: %s", idx, family, strerror(errno));
+		netresolve_history_add(path, false, -1);
 		socket_cleanup(priv, path);
+		/* Start the next attempt without waiting for the delay. */
+		clear_timeout(priv, &priv->attempt_delay);
 	}
 
 	/* See whether we can pass back a ready connection. */
@@ -127,17 +199,38 @@ static void
 connect_ready(netresolve_query_t query, netresolve_watch_t watch, int fd, int events, void *data)
 {
 	struct netresolve_socket *priv = query->user_data;
-	struct netresolve_path *path = data;
+	struct netresolve_path *path = find_path(query, fd);
 	socklen_t len = sizeof(errno);
 
-	assert(fd == path->socket.fd);
 	assert(events & POLLOUT);
-	assert(path->socket.state == SOCKET_STATE_SCHEDULED);
 	assert(path->socket.watch);
 
 	/* Check result of non-blocking `connect()`. */
 	getsockopt(fd, SOL_SOCKET, SO_ERROR, &errno, &len);
+	socket_enter(priv);
 	connect_check(priv, path);
+	socket_leave(priv);
+}
+
+/* set_fastopen:
+ *
+ * With `TCP_FASTOPEN_CONNECT`, `connect()` succeeds right away when the
+ * kernel has a Fast Open cookie for the server and the SYN is sent
+ * together with the first data. Otherwise the connection is established
+ * as usual.
+ */
+static void
+set_fastopen(struct netresolve_socket *priv, int fd)
+{
+#ifdef TCP_FASTOPEN_CONNECT
+	static const int one = 1;
+
+	if (setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof one) == -1)
+		debug_query(priv->query, "socket: cannot enable TCP Fast Open: %s", strerror(errno));
+	errno = 0;
+#else
+	debug_query(priv->query, "socket: TCP Fast Open is not supported");
+#endif
 }
 
 static void
@@ -151,16 +244,24 @@ connect_start(struct netresolve_socket *priv, struct netresolve_path *path)
 
 	assert(path->socket.state == SOCKET_STATE_NONE);
 
+	priv->started = true;
+	priv->last_family = path->node.family;
+	clock_gettime(CLOCK_MONOTONIC, &path->socket.started);
+
 	if (!(sa = netresolve_query_get_sockaddr(priv->query, path - paths, &salen, &socktype, &protocol, NULL))) {
 		error("socket: cannot get socket address");
+		path->socket.state = SOCKET_STATE_DONE;
 		return;
 	}
 
 	/* Attempt a non-blocking connect. */
 	errno = 0;
 	path->socket.fd = socket(sa->sa_family, socktype | O_NONBLOCK, protocol);
-	if (!errno)
+	if (!errno) {
+		if (priv->query->request.tcp_fastopen && socktype == SOCK_STREAM)
+			set_fastopen(priv, path->socket.fd);
 		connect(path->socket.fd, sa, salen);
+	}
 	connect_check(priv, path);
 }
 
@@ -172,90 +273,278 @@ connect_timeout(netresolve_query_t query, netresolve_timeout_t timeout, void *da
 
 	debug_query(query, "socket: connection timeout occured");
 
-	clear_timeouts(priv);
+	clear_timeout(priv, &priv->timeout);
+	clear_timeout(priv, &priv->attempt_delay);
 
 	/* Kill all waited connections. */
-	for (struct netresolve_path *path = paths; path->node.family; path++)
-		if (path->socket.state == SOCKET_STATE_SCHEDULED)
+	for (struct netresolve_path *path = paths; path->node.family; path++) {
+		if (path->socket.state == SOCKET_STATE_SCHEDULED) {
+			if (path->socket.watch)
+				netresolve_history_add(path, false, -1);
 			socket_cleanup(priv, path);
+		}
+	}
 
-	enable_sockets(priv);
+	socket_enter(priv);
+	connect_next_attempt(priv);
+	socket_leave(priv);
 }
 
 static void
-connect_priority_timeout(netresolve_query_t query, netresolve_timeout_t timeout, void *data)
+connect_resolution_delay(netresolve_query_t query, netresolve_timeout_t timeout, void *data)
 {
 	struct netresolve_socket *priv = data;
 
-	debug_query(query, "socket: connection priority timeout occured");
-
-	priv->skip_scheduled = true;
+	debug_query(query, "socket: resolution delay passed without IPv6 addresses");
 
-	pickup_connected_socket(priv);
+	clear_timeout(priv, &priv->resolution_delay);
+	socket_enter(priv);
+	connect_next_attempt(priv);
+	socket_leave(priv);
 }
 
 static void
-enable_sockets(struct netresolve_socket *priv)
+connect_attempt_delay(netresolve_query_t query, netresolve_timeout_t timeout, void *data)
 {
-	netresolve_query_t query = priv->query;
-	struct netresolve_path *paths = query->response.paths;
-	int ip4 = 0, ip6 = 0;
-	int timeout = getenv_int("NETRESOLVE_CONNECT_TIMEOUT", 15);
+	struct netresolve_socket *priv = data;
 
-	/* Attempt to connect to one IPv4 and one IPv6 address in parallel. It is a
-	 * „happy eyeballs“ style optimization that removes a delay when packets
-	 * of the preferred protocol (typically IPvy) are dropped on the way which
-	 * is a very common network misconfiguration.
+	debug_query(query, "socket: connection attempt delay passed");
+
+	clear_timeout(priv, &priv->attempt_delay);
+	socket_enter(priv);
+	connect_next_attempt(priv);
+	socket_leave(priv);
+}
+
+/* get_path_rank:
+ *
+ * Rank an address that wasn't tried yet, zero means it can't be used now.
+ * Addresses that accepted connections recently go first. Those that failed within the cool-down period are
+ * only tried as the last resort after name resolution is finished.
+ * Otherwise address families alternate as recommended by RFC 8305.
+ * Within a family, paths are used in the order they were received,
+ * reachable ones first.
+ */
+static int
+get_path_rank(struct netresolve_socket *priv, struct netresolve_path *path)
+{
+	int history = netresolve_history_rank(path, priv->query->context->config.connect_cooldown);
+	int rank = 1;
+
+	if (path->socket.state != SOCKET_STATE_NONE)
+		return 0;
+	if (history < 0 && !priv->resolved)
+		return 0;
+	/* SRV selection needs to know all targets. */
+	if ((path->priority || path->weight) && !priv->resolved)
+		return 0;
+
+	/* Don't let past successes defeat SRV load balancing. */
+	if (priv->weighted && history > 0)
+		history = 0;
+
+	rank += (history + 1) * 4;
+	if (path->node.family != priv->last_family)
+		rank += 2;
+	if (path->node.reachable)
+		rank += 1;
+
+	return rank;
+}
+
+/* choose_path:
+ *
+ * Pick the next address to connect to. Addresses with the lowest SRV
+ * priority go first and the best ranked ones are picked at random
+ * according to their SRV weights (RFC 2782).
+ */
+static struct netresolve_path *
+choose_path(struct netresolve_socket *priv)
+{
+	struct netresolve_path *paths = priv->query->response.paths;
+	struct netresolve_path *found = NULL;
+	int rank = 0;
+	unsigned int total = 0;
+	unsigned int selected;
+	unsigned int sum = 0;
+
+	/* Other priority groups are only used when all addresses with a lower
+	 * priority have been tried.
 	 */
-	for (struct netresolve_path *path = paths; path->node.family; path++) {
-		/* Skip already attempted sockets. */
-		if (path->socket.state == SOCKET_STATE_DONE)
-			continue;
+	for (size_t i = 0; i < priv->npaths; i++) {
+		struct netresolve_path *path = &paths[i];
+		int path_rank = get_path_rank(priv, path);
 
-		/* Skip all but first address for each protocol. */
-		if (path->node.family == AF_INET && ip4++)
+		if (!path_rank)
 			continue;
-		if (path->node.family == AF_INET6 && ip6++)
+		if (found && path->priority > found->priority)
+			continue;
+		if (found && path->priority == found->priority && path_rank < rank)
 			continue;
 
-		/* Will start or resume connection process, set up the connection timeout. */
-		if (!priv->timeout)
-			priv->timeout = netresolve_timeout_add(priv->query, timeout, 0, connect_timeout, priv);
-
-		if (path->socket.state == SOCKET_STATE_NONE)
-			connect_start(priv, path);
-		else if (path->socket.state == SOCKET_STATE_SCHEDULED && !path->socket.watch) {
-			debug_query(priv->query, "socket: resuming connection %d", path - paths);
-			socket_resume(priv, path, POLLOUT, connect_ready);
+		if (!found || path->priority < found->priority || path_rank > rank) {
+			found = path;
+			rank = path_rank;
+			total = 0;
 		}
+		total += path->weight;
+	}
 
-		/* When in sequential mode, keep only one socket scheduled. */
-		if (priv->sequential_connect)
-			break;
+	if (!total)
+		return found;
+
+	/* Weighted random selection */
+	selected = netresolve_random(total);
+	for (size_t i = 0; i < priv->npaths; i++) {
+		struct netresolve_path *path = &paths[i];
+
+		if (path->priority != found->priority || get_path_rank(priv, path) != rank)
+			continue;
+		if ((sum += path->weight) >= selected)
+			return path;
 	}
 
-	if (!ip4 && !ip6) {
-		error("socket: no connection paths available");
-		clear_timeouts(priv);
+	return found;
+}
+
+static int
+count_attempts(struct netresolve_socket *priv)
+{
+	struct netresolve_path *paths = priv->query->response.paths;
+	int count = 0;
+
+	for (size_t i = 0; i < priv->npaths; i++)
+		if (paths[i].socket.state == SOCKET_STATE_SCHEDULED && paths[i].socket.watch)
+			count++;
+
+	return count;
+}
+
+static bool
+has_family(struct netresolve_socket *priv, int family)
+{
+	struct netresolve_path *paths = priv->query->response.paths;
+
+	for (size_t i = 0; i < priv->npaths; i++)
+		if (paths[i].node.family == family)
+			return true;
+
+	return false;
+}
+
+/* get_attempt_delay:
+ *
+ * Derive the connection attempt delay from recent handshake times for the
+ * family of the last attempt within the bounds given by RFC 8305.
+ */
+static int
+get_attempt_delay(struct netresolve_socket *priv)
+{
+	int rtt = netresolve_history_rtt(priv->last_family, 90);
+
+	if (rtt < 0)
+		return priv->query->context->config.connect_attempt_delay;
+
+	return rtt * 2 < 100 ? 100 : rtt * 2 > 2000 ? 2000 : rtt * 2;
+}
+
+/* get_connect_timeout:
+ *
+ * Derive the connection timeout in milliseconds from recent handshake
+ * times. The configured timeout is the upper bound.
+ */
+static int
+get_connect_timeout(struct netresolve_socket *priv, int family)
+{
+	int timeout = priv->query->context->config.connect_timeout * 1000;
+	int rtt = netresolve_history_rtt(family, 99);
+
+	if (rtt < 0 || rtt * 10 >= timeout)
+		return timeout;
+
+	return rtt * 10 < 1000 ? 1000 : rtt * 10;
+}
+
+/* connect_next_attempt:
+ *
+ * Start another connection attempt unless one is already waiting for the
+ * connection attempt delay. Attempts are started as soon as addresses are
+ * available and are kept in progress in parallel up to the connection
+ * window. Only when the first
+ * answer has no IPv6 address, the resolution delay gives the IPv6 answer
+ * a chance to arrive first.
+ */
+static void
+connect_next_attempt(struct netresolve_socket *priv)
+{
+	netresolve_query_t query = priv->query;
+	struct netresolve_config *config = &query->context->config;
+	int window = query->request.connect_window;
+	struct netresolve_path *path;
+
+	if (priv->paused || priv->resolution_delay || priv->attempt_delay)
+		return;
+
+	if (!priv->delayed && !priv->resolved && query->request.family == AF_UNSPEC && !has_family(priv, AF_INET6)) {
+		if (!priv->npaths)
+			return;
+		priv->delayed = true;
+		if (config->resolution_delay > 0) {
+			debug_query(query, "socket: waiting %d ms for IPv6 addresses", config->resolution_delay);
+			priv->resolution_delay = netresolve_timeout_add_ms(query, config->resolution_delay, connect_resolution_delay, priv);
+			return;
+		}
+	}
+
+	if (window > 0 && count_attempts(priv) >= window)
+		return;
+
+	if (!(path = choose_path(priv))) {
+		if (priv->resolved && !count_attempts(priv)) {
+			error("socket: no connection paths available");
+			clear_timeouts(priv);
+			if (priv->report_failure) {
+				priv->paused = true;
+				priv->callback(query, -1, -1, priv->user_data);
+			}
+		}
+		return;
 	}
+
+	/* Will start the connection process, set up the connection timeout. */
+	if (!priv->timeout)
+		priv->timeout = netresolve_timeout_add_ms(query, get_connect_timeout(priv, path->node.family), connect_timeout, priv);
+
+	connect_start(priv, path);
+
+	/* Stagger the next attempt while this one is in progress. A failed
+	 * attempt has already started the next one. With a full window, the
+	 * next attempt is started when one of those in progress fails.
+	 */
+	if (priv->paused || priv->attempt_delay || !count_attempts(priv))
+		return;
+	if (window > 0 && count_attempts(priv) >= window)
+		return;
+
+	priv->attempt_delay = netresolve_timeout_add_ms(query, get_attempt_delay(priv), connect_attempt_delay, priv);
 }
 
 static void
 pickup_connected_socket(struct netresolve_socket *priv)
 {
 	struct netresolve_path *paths = priv->query->response.paths;
-	struct netresolve_path *found;
+	struct netresolve_path *found = NULL;
 
-	/* Find first scheduled or ready socket. */
-	for (found = paths; found->node.family; found++) {
-		if (found->socket.state == SOCKET_STATE_SCHEDULED && !priv->skip_scheduled)
-			break;
-		if (found->socket.state == SOCKET_STATE_READY)
+	/* Find a ready socket. */
+	for (size_t i = 0; i < priv->npaths; i++) {
+		if (paths[i].socket.state == SOCKET_STATE_READY) {
+			found = &paths[i];
 			break;
+		}
 	}
 
 	/* Pass a ready socket to the application and return. */
-	if (found->socket.state == SOCKET_STATE_READY) {
+	if (found) {
 		int fd = found->socket.fd;
 
 		debug_query(priv->query, "socket: passing successful connection %d to the application", found - paths);
@@ -263,14 +552,22 @@ pickup_connected_socket(struct netresolve_socket *priv)
 		found->socket.state = SOCKET_STATE_DONE;
 		found->socket.fd = -1;
 
-		/* Pause all scheduled sockets. */
-		for (struct netresolve_path *path = paths; path->node.family; path++)
-			if (path->socket.state == SOCKET_STATE_SCHEDULED)
-				socket_pause(priv, path);
+		/* Pause all scheduled sockets. Those started earlier lost the race
+		 * and count as failed.
+		 */
+		for (size_t i = 0; i < priv->npaths; i++) {
+			struct netresolve_path *path = &paths[i];
+
+			if (path->socket.state != SOCKET_STATE_SCHEDULED || !path->socket.watch)
+				continue;
+			if (path->socket.started.tv_sec < found->socket.started.tv_sec
+					|| (path->socket.started.tv_sec == found->socket.started.tv_sec
+						&& path->socket.started.tv_nsec < found->socket.started.tv_nsec))
+				netresolve_history_add(path, false, -1);
+			socket_pause(priv, path);
+		}
 
-		/* Reset timeouts. */
-		if (priv->priority_timeout)
-			priv->skip_scheduled = false;
+		priv->paused = true;
 		clear_timeouts(priv);
 
 		fcntl(fd, F_SETFL, (fcntl(fd, F_GETFL, 0) & ~(SOCK_NONBLOCK | SOCK_CLOEXEC)) | priv->flags);
@@ -279,71 +576,79 @@ pickup_connected_socket(struct netresolve_socket *priv)
 		return;
 	}
 
-	/* Schedule priority timeout if there is a priority socket waiting and
-	 * another socket ready and continue.
-	 */
-	if (found->socket.state == SOCKET_STATE_SCHEDULED) {
-		for (found = paths; found->node.family; found++)
-			if (found->socket.state == SOCKET_STATE_READY)
-				break;
-		if (found->socket.state == SOCKET_STATE_READY) {
-			if (priv->priority_timeout)
-				debug_query(priv->query, "socket: priority timeout already set");
-			else {
-				int priority_timeout = getenv_int("NETRESOLVE_CONNECT_PRIORITY_TIMEOUT", 1);
-
-				debug_query(priv->query, "socket: setting up priority timeout of %d seconds", priority_timeout);
-				priv->priority_timeout = netresolve_timeout_add(priv->query, priority_timeout, 0, connect_priority_timeout, priv);
-			}
-		}
+	/* Make sure connections are scheduled. */
+	connect_next_attempt(priv);
+}
+
+static void
+add_paths(struct netresolve_socket *priv, netresolve_query_t query)
+{
+	struct netresolve_path *paths = query->response.paths;
+
+	priv->query = query;
+
+	for (; priv->npaths < query->response.pathcount; priv->npaths++) {
+		paths[priv->npaths].socket.fd = -1;
+		if (paths[priv->npaths].weight)
+			priv->weighted = true;
 	}
+}
 
-	/* Make sure connections are scheduled. */
-	enable_sockets(priv);
+static void
+connect_path(netresolve_query_t query, size_t idx, void *user_data)
+{
+	struct netresolve_socket *priv = user_data;
+
+	debug_query(query, "socket: address %zu received, will attempt to connect", idx);
+
+	add_paths(priv, query);
+
+	/* The first IPv6 address ends the resolution delay. */
+	if (priv->resolution_delay && query->response.paths[idx].node.family == AF_INET6)
+		clear_timeout(priv, &priv->resolution_delay);
+
+	socket_enter(priv);
+	connect_next_attempt(priv);
+	socket_leave(priv);
 }
 
 static void
 connect_prepare(netresolve_query_t query, void *user_data)
 {
 	struct netresolve_socket *priv = user_data;
-	struct netresolve_path *paths = query->response.paths;
+
+	if (query->state != NETRESOLVE_STATE_DONE && query->state != NETRESOLVE_STATE_FAILED)
+		return;
 
 	debug_query(query, "socket: name resolution done, will attempt to connect");
 
-	for (struct netresolve_path *path = paths; path->node.family; path++)
-		path->socket.fd = -1;
-	priv->query = query;
+	add_paths(priv, query);
+	priv->resolved = true;
+	clear_timeout(priv, &priv->resolution_delay);
 
-	enable_sockets(priv);
+	socket_enter(priv);
+	connect_next_attempt(priv);
+	socket_leave(priv);
 }
 
-/* netresolve_connect:
- *
- * Perform name resolution and connect to a host. The callback is called
- * once, with the first successfully connected socket. If you want to
- * retry with another address, use `netresolve_connect_next()`. The caller
- * is responsible for closing any sockets received through the callback.
- *
- * You should call `netresolve_connect_free()` once you know you're not
- * going to call `netresolve_connect_free()` or any other API functions
- * on the query to free all resources associated with the connection
- * request.
- */
-netresolve_query_t
-netresolve_connect(netresolve_t context,
+static netresolve_query_t
+start_connect(netresolve_t context,
 		const char *nodename, const char *servname,
 		int family, int socktype, int protocol,
-		netresolve_socket_callback_t callback, void *user_data)
+		netresolve_socket_callback_t callback, void *user_data, bool report_failure)
 {
 	int flags = socktype & (SOCK_NONBLOCK | SOCK_CLOEXEC);
 	struct netresolve_socket priv = {
 		.callback = callback,
 		.user_data = user_data,
 		.flags = socktype & (SOCK_NONBLOCK | SOCK_CLOEXEC),
-		.sequential_connect = getenv_bool("NETRESOLVE_SEQUENTIAL_CONNECT", false)
+		.report_failure = report_failure,
+		/* Prefer IPv6 for the first attempt. */
+		.last_family = AF_INET
 	};
+	struct netresolve_socket *data = memdup(&priv, sizeof priv);
 
-	return netresolve_query(context, connect_prepare, memdup(&priv, sizeof priv),
+	return netresolve_query(context, connect_prepare, data,
 			NETRESOLVE_REQUEST_FORWARD,
 			NETRESOLVE_OPTION_NODE_NAME, nodename,
 			NETRESOLVE_OPTION_SERVICE_NAME, servname,
@@ -351,9 +656,35 @@ netresolve_connect(netresolve_t context,
 			NETRESOLVE_OPTION_SOCKTYPE, socktype & ~flags,
 			NETRESOLVE_OPTION_PROTOCOL, protocol,
 			NETRESOLVE_OPTION_DEFAULT_LOOPBACK, true,
+			NETRESOLVE_OPTION_PATH_CALLBACK, connect_path, data,
 			NULL);
 }
 
+/* netresolve_connect:
+ *
+ * Perform name resolution and connect to a host. The callback is called
+ * once, with the first successfully connected socket. If you want to
+ * retry with another address, use `netresolve_connect_next()`. The caller
+ * is responsible for closing any sockets received through the callback.
+ *
+ * Connection attempts follow the Happy Eyeballs algorithm described in
+ * RFC 8305. They start as soon as the first addresses are known, alternate
+ * between address families and overlap after the connection attempt delay.
+ *
+ * You should call `netresolve_connect_free()` once you know you're not
+ * going to call `netresolve_connect_free()` or any other API functions
+ * on the query to free all resources associated with the connection
+ * request.
+ */
+netresolve_query_t
+netresolve_connect(netresolve_t context,
+		const char *nodename, const char *servname,
+		int family, int socktype, int protocol,
+		netresolve_socket_callback_t callback, void *user_data)
+{
+	return start_connect(context, nodename, servname, family, socktype, protocol, callback, user_data, false);
+}
+
 /* netresolve_connect_next:
  *
  * When multiple addresses have been found for the target, retry connection
@@ -363,8 +694,20 @@ void
 netresolve_connect_next(netresolve_query_t query)
 {
 	struct netresolve_socket *priv = query->user_data;
+	struct netresolve_path *paths = query->response.paths;
 
-	enable_sockets(priv);
+	priv->paused = false;
+
+	for (size_t i = 0; i < priv->npaths; i++) {
+		if (paths[i].socket.state == SOCKET_STATE_SCHEDULED && !paths[i].socket.watch) {
+			debug_query(query, "socket: resuming connection %zu", i);
+			socket_resume(priv, &paths[i], POLLOUT, connect_ready);
+		}
+	}
+
+	socket_enter(priv);
+	connect_next_attempt(priv);
+	socket_leave(priv);
 }
 
 /* netresolve_connect_free:
@@ -375,17 +718,25 @@ void
 netresolve_connect_free(netresolve_query_t query)
 {
 	struct netresolve_socket *priv = query->user_data;
-	struct netresolve_path *paths = priv->query->response.paths;
+	struct netresolve_path *paths = query->response.paths;
 
 	debug("socket: cleaning up...");
 
-	for (struct netresolve_path *path = paths; path->node.family; path++)
-		socket_cleanup(priv, path);
+	for (size_t i = 0; i < priv->npaths; i++)
+		socket_cleanup(priv, &paths[i]);
 
 	clear_timeouts(priv);
 
-	memset(priv, 0, sizeof *priv);
-	//free(priv);
+	/* Called back from connection code, which only checks the pause flag
+	 * on the way back.
+	 */
+	if (priv->depth) {
+		priv->paused = true;
+		priv->freed = true;
+	} else {
+		memset(priv, 0, sizeof *priv);
+		free(priv);
+	}
 
 	netresolve_query_free(query);
 }
@@ -394,6 +745,7 @@ static void
 listen_callback(netresolve_query_t query, void *user_data)
 {
 	struct netresolve_socket *priv = user_data;
+	struct netresolve_request *request = &query->request;
 	struct netresolve_path *paths = query->response.paths;
 
 	debug_query(query, "socket: name resolution done, will attempt to listen");
@@ -415,6 +767,16 @@ listen_callback(netresolve_query_t query, void *user_data)
 			continue;
 		if (sa->sa_family == AF_INET6 && setsockopt(path->socket.fd, SOL_IPV6, IPV6_V6ONLY, &one, sizeof one) == -1)
 			continue;
+#ifdef SO_REUSEPORT
+		if (request->reuse_port && setsockopt(path->socket.fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one) == -1)
+			error("socket: cannot share the listening port: %s", strerror(errno));
+#endif
+#ifdef TCP_DEFER_ACCEPT
+		if (request->defer_accept > 0 && socktype == SOCK_STREAM
+				&& setsockopt(path->socket.fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+					&request->defer_accept, sizeof request->defer_accept) == -1)
+			error("socket: cannot defer accepting connections: %s", strerror(errno));
+#endif
 		if (bind(path->socket.fd, sa, salen) == -1 || listen(path->socket.fd, SOMAXCONN) == -1) {
 			close(path->socket.fd);
 			continue;
@@ -424,34 +786,56 @@ listen_callback(netresolve_query_t query, void *user_data)
 	}
 }
 
+static void
+free_listen(netresolve_query_t query)
+{
+	struct netresolve_socket *priv = query->user_data;
+	struct netresolve_path *paths = query->response.paths;
+
+	debug("socket: cleaning up...");
+
+	for (struct netresolve_path *path = paths; path->node.family; path++)
+		socket_cleanup(priv, path);
+
+	memset(priv, 0, sizeof *priv);
+	free(priv);
+
+	netresolve_query_free(query);
+}
+
 static void
 accept_callback(netresolve_query_t query, netresolve_watch_t watch, int event_fd, int events, void *data)
 {
 	struct netresolve_socket *priv = query->user_data;
-	struct netresolve_path *path = data;
+	struct netresolve_path *path = find_path(query, event_fd);
+	int idx = path - query->response.paths;
 	int fd;
-	int flags;
 
-	assert(event_fd == path->socket.fd);
 	assert(events & POLLIN);
-	assert(path->socket.state == SOCKET_STATE_SCHEDULED);
 	assert(path->socket.watch);
 
-	if ((fd = accept(event_fd, NULL, NULL)) == -1)
-		goto fail;
-	if ((flags = fcntl(fd, F_GETFL, 0)) == -1)
-		goto fail;
-	flags &= ~(SOCK_NONBLOCK | SOCK_CLOEXEC);
-	flags |= priv->flags;
-	if ((fcntl(fd, F_SETFL, flags)) == -1)
-		goto fail;
+	/* Drain the accept queue, the application may stop listening from
+	 * the callback.
+	 */
+	priv->accepting = true;
+	while (!priv->freed && path->socket.watch) {
+		if ((fd = accept4(event_fd, NULL, NULL, priv->flags)) == -1) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				error("Error accepting connection: %s", strerror(errno));
+			break;
+		}
 
-	if (priv->callback)
-		priv->callback(query, path - query->response.paths, fd, priv->user_data);
+		if (priv->callback)
+			priv->callback(query, idx, fd, priv->user_data);
+		else
+			close(fd);
+	}
+	priv->accepting = false;
 
-	return;
-fail:
-	error("Error accepting connection: %s", strerror(errno));
+	if (priv->freed)
+		free_listen(query);
 }
 
 /* netresolve_listen:
@@ -509,15 +893,387 @@ void
 netresolve_listen_free(netresolve_query_t query)
 {
 	struct netresolve_socket *priv = query->user_data;
-	struct netresolve_path *paths = query->response.paths;
 
-	debug("socket: cleaning up...");
+	if (priv->accepting) {
+		priv->freed = true;
+		return;
+	}
 
-	for (struct netresolve_path *path = paths; path->node.family; path++)
-		socket_cleanup(priv, path);
+	free_listen(query);
+}
 
-	memset(priv, 0, sizeof *priv);
-	free(priv);
+/* Connection pool
+ *
+ * The pool keeps idle connected sockets per endpoint, i.e. per combination
+ * of node name, service name, family, socket type and protocol. Sockets
+ * are checked before they are handed out again. New connections are made
+ * using `netresolve_connect()` machinery, in the background for nonblocking
+ * contexts to keep at least the minimum number of idle sockets.
+ */
+struct netresolve_endpoint {
+	char *nodename;
+	char *servname;
+	int family;
+	int socktype;
+	int protocol;
+	int *idle;
+	int nidle;
+	/* Background connections in progress. */
+	int pending;
+	struct netresolve_endpoint *next;
+};
 
-	netresolve_query_free(query);
+struct netresolve_connection {
+	struct netresolve_connect_pool *pool;
+	struct netresolve_endpoint *endpoint;
+	netresolve_query_t query;
+	/* Socket handed out to the application. */
+	int fd;
+	bool done;
+	netresolve_connect_pool_callback_t callback;
+	void *user_data;
+	struct netresolve_connection *next;
+};
+
+struct netresolve_connect_pool {
+	netresolve_t context;
+	int min_idle;
+	int max_idle;
+	struct netresolve_endpoint *endpoints;
+	/* Connection requests and sockets lent to the application. */
+	struct netresolve_connection *connections;
+	/* A pool freed from a callback is only released when the outermost
+	 * pool function returns.
+	 */
+	int depth;
+	bool freed;
+};
+
+static bool
+string_equal(const char *s1, const char *s2)
+{
+	if (!s1 || !s2)
+		return s1 == s2;
+
+	return !strcmp(s1, s2);
+}
+
+static struct netresolve_endpoint *
+get_endpoint(struct netresolve_connect_pool *pool,
+		const char *nodename, const char *servname,
+		int family, int socktype, int protocol)
+{
+	struct netresolve_endpoint *endpoint;
+
+	for (endpoint = pool->endpoints; endpoint; endpoint = endpoint->next)
+		if (string_equal(endpoint->nodename, nodename) && string_equal(endpoint->servname, servname)
+				&& endpoint->family == family && endpoint->socktype == socktype
+				&& endpoint->protocol == protocol)
+			return endpoint;
+
+	if (!(endpoint = calloc(1, sizeof *endpoint)))
+		return NULL;
+	if (!(endpoint->idle = calloc(pool->max_idle + 1, sizeof *endpoint->idle))) {
+		free(endpoint);
+		return NULL;
+	}
+
+	endpoint->nodename = nodename ? strdup(nodename) : NULL;
+	endpoint->servname = servname ? strdup(servname) : NULL;
+	endpoint->family = family;
+	endpoint->socktype = socktype;
+	endpoint->protocol = protocol;
+	endpoint->next = pool->endpoints;
+	pool->endpoints = endpoint;
+
+	return endpoint;
+}
+
+/* check_alive:
+ *
+ * An idle socket is only usable when it is connected, has no pending error
+ * and the peer has neither closed the connection nor sent unexpected data.
+ */
+static bool
+check_alive(int fd)
+{
+	int error = 0;
+	socklen_t len = sizeof error;
+	char c;
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1 || error)
+		return false;
+	if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) != -1)
+		return false;
+
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+static void
+keep_idle(struct netresolve_connect_pool *pool, struct netresolve_endpoint *endpoint, int fd)
+{
+	if (endpoint->nidle < pool->max_idle)
+		endpoint->idle[endpoint->nidle++] = fd;
+	else
+		close(fd);
+}
+
+/* collect_connections:
+ *
+ * Queries cannot be freed from their own callbacks, finished connection
+ * requests are freed on the next call to the pool.
+ */
+static void
+collect_connections(struct netresolve_connect_pool *pool)
+{
+	struct netresolve_connection **p = &pool->connections;
+
+	while (*p) {
+		struct netresolve_connection *connection = *p;
+
+		if (connection->query && connection->done) {
+			netresolve_connect_free(connection->query);
+			connection->query = NULL;
+		}
+		if (!connection->query && connection->fd == -1) {
+			*p = connection->next;
+			free(connection);
+		} else
+			p = &connection->next;
+	}
+}
+
+static void
+free_pool(struct netresolve_connect_pool *pool)
+{
+	struct netresolve_endpoint *endpoint;
+	struct netresolve_connection *connection;
+
+	while ((connection = pool->connections)) {
+		pool->connections = connection->next;
+		if (connection->query)
+			netresolve_connect_free(connection->query);
+		free(connection);
+	}
+
+	while ((endpoint = pool->endpoints)) {
+		pool->endpoints = endpoint->next;
+		for (int i = 0; i < endpoint->nidle; i++)
+			close(endpoint->idle[i]);
+		free(endpoint->idle);
+		free(endpoint->nodename);
+		free(endpoint->servname);
+		free(endpoint);
+	}
+
+	free(pool);
+}
+
+static void
+pool_enter(struct netresolve_connect_pool *pool)
+{
+	pool->depth++;
+}
+
+static void
+pool_leave(struct netresolve_connect_pool *pool)
+{
+	if (!--pool->depth && pool->freed)
+		free_pool(pool);
+}
+
+static void
+pool_connected(netresolve_query_t query, int idx, int fd, void *user_data)
+{
+	struct netresolve_connection *connection = user_data;
+	struct netresolve_connect_pool *pool = connection->pool;
+	struct netresolve_endpoint *endpoint = connection->endpoint;
+
+	if (!connection->callback) {
+		endpoint->pending--;
+		if (fd != -1)
+			keep_idle(connection->pool, endpoint, fd);
+		connection->done = true;
+		return;
+	}
+
+	pool_enter(pool);
+	connection->fd = fd;
+	connection->callback(pool, fd, connection->user_data);
+
+	/* The query may only be freed after the callback returns. */
+	connection->done = true;
+	pool_leave(pool);
+}
+
+static void
+start_connection(struct netresolve_connect_pool *pool, struct netresolve_endpoint *endpoint,
+		netresolve_connect_pool_callback_t callback, void *user_data)
+{
+	struct netresolve_connection *connection;
+
+	if (!(connection = calloc(1, sizeof *connection))) {
+		if (callback)
+			callback(pool, -1, user_data);
+		return;
+	}
+
+	connection->pool = pool;
+	connection->endpoint = endpoint;
+	connection->fd = -1;
+	connection->callback = callback;
+	connection->user_data = user_data;
+	connection->next = pool->connections;
+	pool->connections = connection;
+
+	if (!callback)
+		endpoint->pending++;
+
+	connection->query = start_connect(pool->context,
+			endpoint->nodename, endpoint->servname,
+			endpoint->family, endpoint->socktype, endpoint->protocol,
+			pool_connected, connection, true);
+}
+
+static void
+refill(struct netresolve_connect_pool *pool, struct netresolve_endpoint *endpoint)
+{
+	netresolve_t context = pool->context;
+
+	if (pool->freed)
+		return;
+	/* Blocking contexts would wait for the connections right away. */
+	if (!context->callbacks.add_watch || context->callbacks.user_data == &context->epoll)
+		return;
+
+	while (endpoint->nidle + endpoint->pending < pool->min_idle)
+		start_connection(pool, endpoint, NULL, NULL);
+}
+
+/* netresolve_connect_pool_new:
+ *
+ * Create a pool of connections made using the context. Up to `max_idle`
+ * released sockets are kept per endpoint. With a nonblocking context, new
+ * connections are opened in the background so that at least `min_idle`
+ * sockets are ready for endpoints that have been used.
+ */
+netresolve_connect_pool_t
+netresolve_connect_pool_new(netresolve_t context, int min_idle, int max_idle)
+{
+	struct netresolve_connect_pool *pool;
+
+	if (!context)
+		context = netresolve_context_get_default();
+	if (!context || !(pool = calloc(1, sizeof *pool)))
+		return NULL;
+
+	pool->context = context;
+	pool->max_idle = max_idle > 0 ? max_idle : 0;
+	pool->min_idle = min_idle < pool->max_idle ? min_idle : pool->max_idle;
+
+	return pool;
+}
+
+/* netresolve_connect_pool_free:
+ *
+ * Close idle sockets and cancel connections in progress. Sockets handed out
+ * to the application stay open.
+ */
+void
+netresolve_connect_pool_free(netresolve_connect_pool_t pool)
+{
+	if (pool->depth)
+		pool->freed = true;
+	else
+		free_pool(pool);
+}
+
+/* netresolve_connect_pooled:
+ *
+ * Get a connected socket for the endpoint. An idle socket is passed to the
+ * callback right away, otherwise a new connection is made as with
+ * `netresolve_connect()`. The callback receives -1 when the connection
+ * cannot be made. Pass the socket back using `netresolve_connect_release()`
+ * instead of closing it.
+ */
+void
+netresolve_connect_pooled(netresolve_connect_pool_t pool,
+		const char *nodename, const char *servname,
+		int family, int socktype, int protocol,
+		netresolve_connect_pool_callback_t callback, void *user_data)
+{
+	struct netresolve_endpoint *endpoint;
+	struct netresolve_connection *connection;
+
+	pool_enter(pool);
+	collect_connections(pool);
+
+	if (!(endpoint = get_endpoint(pool, nodename, servname, family, socktype, protocol))) {
+		callback(pool, -1, user_data);
+		goto out;
+	}
+
+	while (endpoint->nidle) {
+		int fd = endpoint->idle[--endpoint->nidle];
+
+		if (!check_alive(fd)) {
+			debug("socket: dropping dead idle connection %d", fd);
+			close(fd);
+			continue;
+		}
+		if (!(connection = calloc(1, sizeof *connection))) {
+			keep_idle(pool, endpoint, fd);
+			break;
+		}
+
+		connection->pool = pool;
+		connection->endpoint = endpoint;
+		connection->fd = fd;
+		connection->next = pool->connections;
+		pool->connections = connection;
+
+		refill(pool, endpoint);
+		callback(pool, fd, user_data);
+		goto out;
+	}
+
+	start_connection(pool, endpoint, callback, user_data);
+	refill(pool, endpoint);
+out:
+	pool_leave(pool);
+}
+
+/* netresolve_connect_release:
+ *
+ * Return a socket received from `netresolve_connect_pooled()`. When `reuse`
+ * is set and the connection is still usable, it is kept for another
+ * request to the same endpoint, otherwise it is closed. Sockets the pool
+ * didn't hand out are left alone and false is returned.
+ */
+bool
+netresolve_connect_release(netresolve_connect_pool_t pool, int sock, bool reuse)
+{
+	struct netresolve_connection *connection;
+
+	if (sock < 0)
+		return false;
+
+	for (connection = pool->connections; connection; connection = connection->next)
+		if (connection->fd == sock)
+			break;
+
+	if (!connection) {
+		error("socket: connection %d doesn't belong to the pool", sock);
+		return false;
+	}
+
+	connection->fd = -1;
+	if (reuse && check_alive(sock))
+		keep_idle(pool, connection->endpoint, sock);
+	else
+		close(sock);
+
+	collect_connections(pool);
+
+	return true;
 }
@@ -0,0 +1,461 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <netresolve-submit.h>
+#include <netresolve-private.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+/* Submission from other threads
+ *
+ * Queries for a context running in one thread can be submitted from any
+ * other thread. Submissions and completions are pushed to lock-free lists
+ * and taken by the single consumer all at once. An eventfd is only
+ * written to when a list becomes non-empty.
+ */
+struct netresolve_node {
+	struct netresolve_node *next;
+};
+
+enum netresolve_submission_type {
+	NETRESOLVE_SUBMISSION_START,
+	NETRESOLVE_SUBMISSION_FREE
+};
+
+struct netresolve_submission {
+	struct netresolve_node node;
+	enum netresolve_submission_type type;
+	struct netresolve_request request;
+	netresolve_completion_t completion;
+	netresolve_query_callback callback;
+	void *user_data;
+	netresolve_query_t query;
+};
+
+struct netresolve_completion_entry {
+	struct netresolve_node node;
+	netresolve_query_t query;
+	void *user_data;
+};
+
+struct netresolve_completion {
+	struct netresolve_node *head;
+	/* Accessed by the consumer only. */
+	struct netresolve_node *pending;
+	int fd;
+};
+
+/* push_node:
+ *
+ * Push a node from any thread. Returns true when the list was empty.
+ */
+static bool
+push_node(struct netresolve_node **head, struct netresolve_node *node)
+{
+	struct netresolve_node *first = __atomic_load_n(head, __ATOMIC_RELAXED);
+
+	do
+		node->next = first;
+	while (!__atomic_compare_exchange_n(head, &first, node, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	return !first;
+}
+
+/* take_nodes:
+ *
+ * Take all nodes from the list in the order they were pushed.
+ */
+static struct netresolve_node *
+take_nodes(struct netresolve_node **head)
+{
+	struct netresolve_node *node = __atomic_exchange_n(head, NULL, __ATOMIC_ACQUIRE);
+	struct netresolve_node *list = NULL, *next;
+
+	for (; node; node = next) {
+		next = node->next;
+		node->next = list;
+		list = node;
+	}
+
+	return list;
+}
+
+static void
+wake(int fd)
+{
+	uint64_t value = 1;
+
+	if (write(fd, &value, sizeof value) == -1)
+		error("eventfd write: %s", strerror(errno));
+}
+
+static void
+clear(int fd)
+{
+	uint64_t value;
+
+	if (read(fd, &value, sizeof value) == -1 && errno != EAGAIN)
+		error("eventfd read: %s", strerror(errno));
+}
+
+static void
+free_submission(struct netresolve_submission *submission)
+{
+	free(submission->request.nodename);
+	free(submission->request.servname);
+	free(submission->request.dns_name);
+	free(submission);
+}
+
+static void
+push_submission(netresolve_t context, struct netresolve_submission *submission)
+{
+	if (push_node(&context->submit.head, &submission->node))
+		wake(context->submit.fd);
+}
+
+/* finish_submission:
+ *
+ * Called in the context thread when a submitted query is finished. Queries
+ * with a completion queue are freed by the consumer through
+ * `netresolve_submit_free()`, those with an internal callback are freed
+ * right after the callback. In both cases the query is freed from the
+ * submission list as it cannot be freed from its own callback.
+ */
+static void
+finish_submission(netresolve_query_t query, void *user_data)
+{
+	struct netresolve_submission *submission = user_data;
+	netresolve_completion_t completion = submission->completion;
+
+	/* More mandatory backends are going to be run. */
+	if (query->state != NETRESOLVE_STATE_DONE && query->state != NETRESOLVE_STATE_FAILED)
+		return;
+
+	if (completion) {
+		struct netresolve_completion_entry *entry = calloc(1, sizeof *entry);
+
+		if (!entry)
+			abort();
+		entry->query = query;
+		entry->user_data = submission->user_data;
+		if (push_node(&completion->head, &entry->node))
+			wake(completion->fd);
+		return;
+	}
+
+	if (submission->callback)
+		submission->callback(query, submission->user_data);
+	netresolve_submit_free(query->context, query);
+}
+
+static void
+start_submission(netresolve_t context, struct netresolve_submission *submission)
+{
+	netresolve_query_t query;
+
+	if (!(query = netresolve_query_new(context, submission->request.type))) {
+		free_submission(submission);
+		return;
+	}
+
+	/* The query takes over the strings of the submitted request. */
+	memcpy(&query->request, &submission->request, sizeof query->request);
+	memset(&submission->request, 0, sizeof submission->request);
+	query->callback = finish_submission;
+	query->user_data = submission;
+
+	netresolve_query_start(query);
+}
+
+static void
+dispatch_submissions(netresolve_query_t query, netresolve_watch_t watch, int fd, int events, void *data)
+{
+	netresolve_t context = data;
+	struct netresolve_node *node, *next;
+
+	/* Clear the eventfd first not to miss any submission. */
+	clear(context->submit.fd);
+
+	for (node = take_nodes(&context->submit.head); node; node = next) {
+		struct netresolve_submission *submission = (struct netresolve_submission *) node;
+
+		next = node->next;
+
+		switch (submission->type) {
+		case NETRESOLVE_SUBMISSION_START:
+			start_submission(context, submission);
+			break;
+		case NETRESOLVE_SUBMISSION_FREE:
+			free_submission(submission->query->user_data);
+			netresolve_query_free(submission->query);
+			free_submission(submission);
+			break;
+		}
+	}
+}
+
+/* netresolve_submit_setup:
+ *
+ * Prepare a nonblocking context for queries submitted from other threads.
+ * Call it from the thread running the context's main loop before
+ * submitting any queries. Context options are taken from the context at
+ * this moment.
+ */
+bool
+netresolve_submit_setup(netresolve_t context)
+{
+	struct netresolve_submit *submit = &context->submit;
+
+	if (submit->watching)
+		return true;
+	if (!context->callbacks.add_watch || context->callbacks.user_data == &context->epoll)
+		return false;
+
+	if ((submit->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		error("eventfd: %s", strerror(errno));
+		return false;
+	}
+
+	netresolve_request_copy(&submit->request, &context->request);
+
+	submit->watch.fd = submit->fd;
+	submit->watch.callback = dispatch_submissions;
+	submit->watch.data = context;
+	submit->watch.handle = context->callbacks.add_watch(context, submit->fd, POLLIN, &submit->watch);
+	submit->watching = true;
+
+	return true;
+}
+
+void
+netresolve_submit_cleanup(netresolve_t context)
+{
+	struct netresolve_submit *submit = &context->submit;
+	struct netresolve_query *queries = &context->queries;
+	struct netresolve_node *node, *next;
+
+	if (!submit->watching)
+		return;
+
+	context->callbacks.remove_watch(context, submit->fd, submit->watch.handle);
+	close(submit->fd);
+	submit->fd = -1;
+	submit->watching = false;
+
+	for (node = take_nodes(&submit->head); node; node = next) {
+		next = node->next;
+		free_submission((struct netresolve_submission *) node);
+	}
+
+	/* Submitted queries are freed with the context without callbacks. */
+	for (netresolve_query_t query = queries->next; query != queries; query = query->next) {
+		if (query->callback == finish_submission) {
+			free_submission(query->user_data);
+			query->callback = NULL;
+			query->user_data = NULL;
+		}
+	}
+
+	free(submit->request.nodename);
+	free(submit->request.servname);
+	free(submit->request.dns_name);
+	memset(&submit->request, 0, sizeof submit->request);
+}
+
+/* netresolve_submit_request:
+ *
+ * Internal variant of `netresolve_submit()` taking over a prepared request
+ * and calling the callback in the context thread. The query is freed when
+ * the callback returns.
+ */
+bool
+netresolve_submit_request(netresolve_t context, struct netresolve_request *take_request,
+		netresolve_query_callback callback, void *user_data)
+{
+	struct netresolve_submission *submission = calloc(1, sizeof *submission);
+
+	if (!submission)
+		return false;
+
+	submission->type = NETRESOLVE_SUBMISSION_START;
+	memcpy(&submission->request, take_request, sizeof submission->request);
+	memset(take_request, 0, sizeof *take_request);
+	submission->callback = callback;
+	submission->user_data = user_data;
+
+	push_submission(context, submission);
+
+	return true;
+}
+
+void
+netresolve_submit_wake(netresolve_t context)
+{
+	wake(context->submit.fd);
+}
+
+/* netresolve_submit:
+ *
+ * Submit a query from any thread, using the same options as
+ * `netresolve_query()`. The finished query is delivered to the completion
+ * queue together with `user_data`.
+ */
+bool
+netresolve_submit(netresolve_t context, netresolve_completion_t completion, void *user_data,
+		enum netresolve_option type, ...)
+{
+	struct netresolve_submission *submission;
+	va_list ap;
+	bool ok;
+
+	if (!(submission = calloc(1, sizeof *submission)))
+		return false;
+
+	submission->type = NETRESOLVE_SUBMISSION_START;
+	netresolve_request_copy(&submission->request, &context->submit.request);
+	submission->request.type = type;
+	submission->completion = completion;
+	submission->user_data = user_data;
+
+	va_start(ap, type);
+	ok = netresolve_request_set_options_from_va(&submission->request, ap);
+	va_end(ap);
+
+	if (!ok) {
+		free_submission(submission);
+		return false;
+	}
+
+	push_submission(context, submission);
+
+	return true;
+}
+
+bool
+netresolve_submit_forward(netresolve_t context,
+		const char *nodename, const char *servname,
+		netresolve_completion_t completion, void *user_data)
+{
+	return netresolve_submit(context, completion, user_data,
+			NETRESOLVE_REQUEST_FORWARD,
+			NETRESOLVE_OPTION_NODE_NAME, nodename,
+			NETRESOLVE_OPTION_SERVICE_NAME, servname,
+			NULL);
+}
+
+/* netresolve_submit_free:
+ *
+ * Hand a finished query back to the context thread to be freed. It can be
+ * called from any thread.
+ */
+void
+netresolve_submit_free(netresolve_t context, netresolve_query_t query)
+{
+	struct netresolve_submission *submission = calloc(1, sizeof *submission);
+
+	if (!submission)
+		abort();
+
+	submission->type = NETRESOLVE_SUBMISSION_FREE;
+	submission->query = query;
+
+	push_submission(context, submission);
+}
+
+/* netresolve_completion_new:
+ *
+ * Create a queue of finished queries. Poll its file descriptor for reading
+ * and retrieve the queries using `netresolve_completion_next()` from a
+ * single thread.
+ */
+netresolve_completion_t
+netresolve_completion_new(void)
+{
+	netresolve_completion_t completion = calloc(1, sizeof *completion);
+
+	if (!completion)
+		return NULL;
+
+	if ((completion->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+		error("eventfd: %s", strerror(errno));
+		free(completion);
+		return NULL;
+	}
+
+	return completion;
+}
+
+void
+netresolve_completion_free(netresolve_completion_t completion)
+{
+	struct netresolve_node *node, *next;
+
+	for (node = completion->pending; node; node = next) {
+		next = node->next;
+		free(node);
+	}
+	for (node = take_nodes(&completion->head); node; node = next) {
+		next = node->next;
+		free(node);
+	}
+
+	close(completion->fd);
+	free(completion);
+}
+
+int
+netresolve_completion_fd(netresolve_completion_t completion)
+{
+	return completion->fd;
+}
+
+/* netresolve_completion_next:
+ *
+ * Retrieve the next finished query or NULL if there's none. Read the
+ * results and pass the query to `netresolve_submit_free()`.
+ */
+netresolve_query_t
+netresolve_completion_next(netresolve_completion_t completion, void **user_data)
+{
+	struct netresolve_completion_entry *entry;
+	netresolve_query_t query;
+
+	if (!completion->pending) {
+		clear(completion->fd);
+		if (!(completion->pending = take_nodes(&completion->head)))
+			return NULL;
+	}
+
+	entry = (struct netresolve_completion_entry *) completion->pending;
+	completion->pending = entry->node.next;
+
+	query = entry->query;
+	if (user_data)
+		*user_data = entry->user_data;
+	free(entry);
+
+	return query;
+}
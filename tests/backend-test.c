@@ -0,0 +1,253 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+/* Synthetic backend for the test suite
+ *
+ * Each setting adds one address in the form ADDRESS[/PRIORITY/WEIGHT][@DELAY]
+ * where DELAY is in milliseconds, `ttl=SECONDS` applies to the following
+ * addresses and `fail[@DELAY]` makes the backend fail. The query is
+ * finished once all addresses have been added.
+ *
+ *     test 192.0.2.1 2001:db8::1@50 ttl=5 192.0.2.2/10/5@100
+ *
+ * Reverse queries are answered with `reverse.test` right away. DNS queries
+ * are answered with a single A record of 192.0.2.53 using the last `ttl`
+ * setting.
+ */
+#include <netresolve-backend.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "backend-test.h"
+
+struct test_backend_stats test_backend_stats;
+
+struct item {
+	int family;
+	Address address;
+	int ifindex;
+	int priority;
+	int weight;
+	int ttl;
+	bool fail;
+	netresolve_timeout_t timeout;
+};
+
+struct priv {
+	netresolve_query_t query;
+	struct item *items;
+	int count;
+	int pending;
+	bool finished;
+};
+
+static void
+cleanup(void *data)
+{
+	struct priv *priv = data;
+
+	if (!priv->finished)
+		__atomic_add_fetch(&test_backend_stats.cancelled, 1, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&test_backend_stats.active, 1, __ATOMIC_SEQ_CST);
+
+	for (int i = 0; i < priv->count; i++)
+		if (priv->items[i].timeout)
+			netresolve_timeout_remove(priv->query, priv->items[i].timeout);
+	free(priv->items);
+}
+
+static void
+finish(struct priv *priv, bool fail)
+{
+	priv->finished = true;
+
+	if (fail)
+		netresolve_backend_failed(priv->query);
+	else
+		netresolve_backend_finished(priv->query);
+}
+
+static void
+apply_item(struct priv *priv, struct item *item)
+{
+	if (item->fail) {
+		finish(priv, true);
+		return;
+	}
+
+	netresolve_backend_add_path(priv->query, item->family, &item->address, item->ifindex,
+			0, 0, 0, item->priority, item->weight, item->ttl);
+
+	if (!--priv->pending && !priv->finished)
+		finish(priv, false);
+}
+
+static void
+item_timeout(netresolve_query_t query, netresolve_timeout_t timeout, void *data)
+{
+	struct priv *priv = netresolve_backend_get_priv(query);
+	struct item *item = data;
+
+	netresolve_timeout_remove(query, timeout);
+	item->timeout = NULL;
+
+	apply_item(priv, item);
+}
+
+static bool
+parse_item(struct item *item, char *setting, int ttl)
+{
+	char *delay = strchr(setting, '@');
+	char *aux = strchr(setting, '/');
+
+	if (delay)
+		*delay++ = '\0';
+	if (aux)
+		*aux++ = '\0';
+
+	item->ttl = ttl;
+	if (!strcmp(setting, "fail"))
+		item->fail = true;
+	else if (!netresolve_backend_parse_address(setting, &item->address, &item->family, &item->ifindex))
+		return false;
+	if (aux && sscanf(aux, "%d/%d", &item->priority, &item->weight) != 2)
+		return false;
+
+	return true;
+}
+
+void
+query_forward(netresolve_query_t query, char **settings)
+{
+	struct priv *priv = netresolve_backend_new_priv(query, sizeof *priv, cleanup);
+	int active;
+	int ttl = 60;
+
+	if (!priv) {
+		netresolve_backend_failed(query);
+		return;
+	}
+
+	priv->query = query;
+
+	__atomic_add_fetch(&test_backend_stats.runs, 1, __ATOMIC_SEQ_CST);
+	active = __atomic_add_fetch(&test_backend_stats.active, 1, __ATOMIC_SEQ_CST);
+	for (int max = test_backend_stats.max_active; active > max;)
+		if (__atomic_compare_exchange_n(&test_backend_stats.max_active, &max, active, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+			break;
+
+	for (char **setting = settings; *setting; setting++)
+		priv->count++;
+	if (!(priv->items = calloc(priv->count, sizeof *priv->items))) {
+		finish(priv, true);
+		return;
+	}
+
+	/* Immediate items are applied after all delayed ones are scheduled. */
+	priv->count = 0;
+	for (char **setting = settings; *setting; setting++) {
+		struct item *item = &priv->items[priv->count];
+		char buffer[1024];
+		char *delay;
+
+		snprintf(buffer, sizeof buffer, "%s", *setting);
+		if (!strncmp(buffer, "ttl=", 4)) {
+			ttl = atoi(buffer + 4);
+			continue;
+		}
+		if (!parse_item(item, buffer, ttl)) {
+			error("test: cannot parse setting '%s'", *setting);
+			continue;
+		}
+		if ((delay = strchr(*setting, '@')))
+			item->timeout = netresolve_timeout_add_ms(query, atoi(delay + 1), item_timeout, item);
+		priv->count++;
+		if (!item->fail)
+			priv->pending++;
+	}
+
+	for (int i = 0; i < priv->count && !priv->finished; i++)
+		if (!priv->items[i].timeout)
+			apply_item(priv, &priv->items[i]);
+
+	if (!priv->count)
+		finish(priv, true);
+}
+
+void
+query_reverse(netresolve_query_t query, char **settings)
+{
+	__atomic_add_fetch(&test_backend_stats.runs, 1, __ATOMIC_SEQ_CST);
+
+	netresolve_backend_add_name_info(query, "reverse.test", NULL);
+	netresolve_backend_finished(query);
+}
+
+void
+query_dns(netresolve_query_t query, char **settings)
+{
+	unsigned char answer[512] = { 0, 0, 0x81, 0x80, 0, 1, 0, 1 };
+	size_t length = 12;
+	const char *name;
+	int cls, type;
+	int ttl = 60;
+
+	__atomic_add_fetch(&test_backend_stats.runs, 1, __ATOMIC_SEQ_CST);
+
+	for (char **setting = settings; *setting; setting++)
+		if (!strncmp(*setting, "ttl=", 4))
+			ttl = atoi(*setting + 4);
+
+	/* Question */
+	name = netresolve_backend_get_dns_query(query, &cls, &type);
+	while (*name) {
+		size_t label = strcspn(name, ".");
+
+		if (label > 63 || length + label + 1 > 256) {
+			netresolve_backend_failed(query);
+			return;
+		}
+		answer[length++] = label;
+		memcpy(answer + length, name, label);
+		length += label;
+		name += label;
+		if (*name)
+			name++;
+	}
+	answer[length++] = 0;
+	answer[length++] = type >> 8;
+	answer[length++] = type;
+	answer[length++] = cls >> 8;
+	answer[length++] = cls;
+
+	/* Answer pointing back to the question name */
+	memcpy(answer + length, (unsigned char[]) {
+			0xc0, 12, 0, 1, 0, 1,
+			ttl >> 24, ttl >> 16, ttl >> 8, ttl,
+			0, 4, 192, 0, 2, 53 }, 16);
+	length += 16;
+
+	netresolve_backend_set_dns_answer(query, answer, length);
+	netresolve_backend_finished(query);
+}
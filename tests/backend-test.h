@@ -0,0 +1,65 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef BACKEND_TEST_H
+#define BACKEND_TEST_H
+
+#include <dlfcn.h>
+#include <stdlib.h>
+
+/* Statistics kept by the synthetic `test` backend. */
+struct test_backend_stats {
+	int runs;
+	int active;
+	int max_active;
+	int cancelled;
+};
+
+#define TEST_BACKEND_MODULE "libnetresolve-backend-test.so.0"
+
+/* Access the statistics of the module loaded by libnetresolve. */
+static inline struct test_backend_stats *
+test_backend_get_stats(void)
+{
+	void *handle = dlopen(TEST_BACKEND_MODULE, RTLD_NOW);
+	struct test_backend_stats *stats = handle ? dlsym(handle, "test_backend_stats") : NULL;
+
+	if (!stats)
+		abort();
+
+	return stats;
+}
+
+/* Check whether libnetresolve has already loaded the module. */
+static inline int
+test_backend_loaded(void)
+{
+	void *handle = dlopen(TEST_BACKEND_MODULE, RTLD_NOW | RTLD_NOLOAD);
+
+	if (handle)
+		dlclose(handle);
+
+	return !!handle;
+}
+
+#endif /* BACKEND_TEST_H */
@@ -0,0 +1,162 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <netresolve.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+
+#include "backend-test.h"
+
+static long
+get_time_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void
+check_query(netresolve_t context, const char *node, const char *expected)
+{
+	netresolve_query_t query = netresolve_query_forward(context, node, NULL, NULL, NULL);
+	char buffer[INET6_ADDRSTRLEN];
+	const void *address;
+	int family;
+
+	assert(query);
+	assert(netresolve_query_get_count(query) == 1);
+	netresolve_query_get_node_info(query, 0, &family, &address, NULL);
+	assert(inet_ntop(family, address, buffer, sizeof buffer));
+	assert(!strcmp(buffer, expected));
+
+	netresolve_query_free(query);
+}
+
+/* Backend modules are only loaded when a query reaches them. */
+static void
+test_lazy_load(void)
+{
+	netresolve_t context = netresolve_context_new();
+
+	netresolve_set_backend_string(context, "numerichost|test 192.0.2.1");
+	assert(!test_backend_loaded());
+
+	check_query(context, "192.0.2.9", "192.0.2.9");
+	assert(!test_backend_loaded());
+
+	check_query(context, "lazy.test", "192.0.2.1");
+	assert(test_backend_loaded());
+
+	netresolve_context_free(context);
+}
+
+/* The first group member to answer wins and the others are cancelled. */
+static void
+test_group(struct test_backend_stats *stats)
+{
+	netresolve_t context = netresolve_context_new();
+	int runs = stats->runs;
+	int cancelled = stats->cancelled;
+	long start = get_time_ms();
+
+	netresolve_set_backend_string(context, "{test 192.0.2.1,test 192.0.2.2@1000,test fail@2000}");
+	check_query(context, "group.test", "192.0.2.1");
+	assert(get_time_ms() - start < 1000);
+	assert(stats->runs == runs + 3);
+	assert(stats->cancelled == cancelled + 2);
+	assert(stats->active == 0);
+
+	/* A failing member doesn't stop the others. */
+	netresolve_set_backend_string(context, "{test fail,test 192.0.2.3@20}");
+	check_query(context, "failover.test", "192.0.2.3");
+	assert(stats->active == 0);
+
+	netresolve_context_free(context);
+}
+
+/* Names are routed by the most specific matching domain suffix. */
+static void
+count_path(netresolve_query_t query, size_t idx, void *user_data)
+{
+	size_t *reported = user_data;
+
+	assert(idx == (*reported)++);
+}
+
+/* A group after another backend adds to the response of the chain, and
+ * its paths are reported like any other.
+ */
+static void
+test_group_in_chain(void)
+{
+	netresolve_t context = netresolve_context_new();
+	netresolve_query_t query;
+	size_t reported = 0;
+
+	netresolve_set_backend_string(context, "test 192.0.2.1|+{test 192.0.2.2,test 192.0.2.3@1000}");
+	netresolve_context_set_options(context,
+			NETRESOLVE_OPTION_PATH_CALLBACK, count_path, &reported,
+			NETRESOLVE_OPTION_DONE);
+
+	query = netresolve_query_forward(context, "chain.test", NULL, NULL, NULL);
+	assert(query);
+	assert(netresolve_query_get_count(query) == 2);
+	assert(reported == 2);
+	netresolve_query_free(query);
+
+	netresolve_context_free(context);
+}
+
+static void
+test_routes(void)
+{
+	netresolve_t context;
+
+	setenv("NETRESOLVE_ROUTES", "example.test=test 192.0.2.10;sub.example.test=test 192.0.2.11", true);
+	context = netresolve_context_new();
+	netresolve_set_backend_string(context, "test 192.0.2.12");
+
+	check_query(context, "example.test", "192.0.2.10");
+	check_query(context, "host.example.test", "192.0.2.10");
+	check_query(context, "host.sub.example.test", "192.0.2.11");
+	check_query(context, "host.notexample.test", "192.0.2.12");
+	check_query(context, "other.test", "192.0.2.12");
+
+	netresolve_context_free(context);
+	unsetenv("NETRESOLVE_ROUTES");
+}
+
+int
+main(int argc, char **argv)
+{
+	test_lazy_load();
+	test_group(test_backend_get_stats());
+	test_group_in_chain();
+	test_routes();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,263 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <netresolve.h>
+#include <netresolve-epoll.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "backend-test.h"
+
+static void
+check_address(netresolve_query_t query, const char *expected)
+{
+	char buffer[INET6_ADDRSTRLEN];
+	const void *address;
+	int family;
+
+	assert(netresolve_query_get_count(query) == 1);
+	netresolve_query_get_node_info(query, 0, &family, &address, NULL);
+	assert(inet_ntop(family, address, buffer, sizeof buffer));
+	assert(!strcmp(buffer, expected));
+}
+
+static int
+get_ttl(netresolve_query_t query)
+{
+	int ttl;
+
+	netresolve_query_get_aux_info(query, 0, NULL, NULL, &ttl);
+
+	return ttl;
+}
+
+static void
+callback(netresolve_query_t query, void *user_data)
+{
+	int *finished = user_data;
+
+	check_address(query, "192.0.2.2");
+	(*finished)++;
+}
+
+/* Cache hits report the time to live left. */
+static void
+test_ttl(struct test_backend_stats *stats)
+{
+	netresolve_t context = netresolve_context_new();
+	netresolve_query_t query;
+	int runs = stats->runs;
+
+	netresolve_set_backend_string(context, "test ttl=30 192.0.2.1");
+
+	query = netresolve_query_forward(context, "ttl.test", NULL, NULL, NULL);
+	check_address(query, "192.0.2.1");
+	assert(get_ttl(query) == 30);
+	netresolve_query_free(query);
+	assert(stats->runs == runs + 1);
+
+	sleep(1);
+
+	query = netresolve_query_forward(context, "ttl.test", NULL, NULL, NULL);
+	check_address(query, "192.0.2.1");
+	assert(get_ttl(query) < 30);
+	netresolve_query_free(query);
+	assert(stats->runs == runs + 1);
+
+	netresolve_context_free(context);
+}
+
+static int
+get_dns_ttl(netresolve_query_t query)
+{
+	size_t size;
+	const unsigned char *answer = netresolve_query_get_dns_answer(query, &size);
+
+	/* The test backend answers with a single A record at the end. */
+	assert(answer && size > 16);
+	answer += size - 16 + 6;
+
+	return answer[0] << 24 | answer[1] << 16 | answer[2] << 8 | answer[3];
+}
+
+/* DNS answers are cached according to the TTL of their records, which
+ * is updated on cache hits.
+ */
+static void
+test_dns(struct test_backend_stats *stats)
+{
+	netresolve_t context = netresolve_context_new();
+	netresolve_query_t query;
+	int runs = stats->runs;
+
+	netresolve_set_backend_string(context, "test ttl=30");
+
+	query = netresolve_query_dns(context, "dns.test", ns_c_in, ns_t_a, NULL, NULL);
+	assert(get_dns_ttl(query) == 30);
+	netresolve_query_free(query);
+
+	sleep(1);
+
+	query = netresolve_query_dns(context, "dns.test", ns_c_in, ns_t_a, NULL, NULL);
+	assert(get_dns_ttl(query) < 30);
+	netresolve_query_free(query);
+	assert(stats->runs == runs + 1);
+
+	netresolve_context_free(context);
+}
+
+/* Responses to reverse queries carry no TTL but are cached as well. */
+static void
+test_reverse(struct test_backend_stats *stats)
+{
+	netresolve_t context = netresolve_context_new();
+	struct in_addr address = { htonl(0xc0000201) };
+	netresolve_query_t query;
+	int runs = stats->runs;
+
+	netresolve_set_backend_string(context, "test");
+
+	for (int i = 0; i < 2; i++) {
+		query = netresolve_query_reverse(context, AF_INET, &address, 0, 0, 0, NULL, NULL);
+		assert(query);
+		assert(!strcmp(netresolve_query_get_node_name(query), "reverse.test"));
+		netresolve_query_free(query);
+	}
+	assert(stats->runs == runs + 1);
+
+	netresolve_context_free(context);
+}
+
+/* Identical queries in progress share one backend run. */
+static void
+test_concurrent(struct test_backend_stats *stats)
+{
+	netresolve_t context = netresolve_context_new();
+	netresolve_query_t query1, query2;
+	int runs = stats->runs;
+	int finished = 0;
+
+	netresolve_epoll_fd(context);
+	netresolve_set_backend_string(context, "test 192.0.2.2@50");
+
+	query1 = netresolve_query_forward(context, "concurrent.test", NULL, callback, &finished);
+	query2 = netresolve_query_forward(context, "concurrent.test", NULL, callback, &finished);
+	assert(query1 && query2);
+
+	netresolve_epoll_wait(context);
+	assert(finished == 2);
+	assert(stats->runs == runs + 1);
+
+	netresolve_query_free(query1);
+	netresolve_query_free(query2);
+	netresolve_context_free(context);
+}
+
+struct leader {
+	netresolve_query_t query;
+	int leader_finished;
+	int follower_finished;
+};
+
+static void
+leader_callback(netresolve_query_t query, void *user_data)
+{
+	struct leader *data = user_data;
+
+	data->leader_finished++;
+}
+
+static void
+follower_callback(netresolve_query_t query, void *user_data)
+{
+	struct leader *data = user_data;
+
+	data->follower_finished++;
+	netresolve_query_free(data->query);
+}
+
+/* A query attached to another one may free it from its callback. */
+static void
+test_free_leader(const char *backends, const char *node)
+{
+	netresolve_t context = netresolve_context_new();
+	struct leader data = { 0 };
+	netresolve_query_t follower;
+
+	netresolve_epoll_fd(context);
+	netresolve_set_backend_string(context, backends);
+
+	data.query = netresolve_query_forward(context, node, NULL, leader_callback, &data);
+	follower = netresolve_query_forward(context, node, NULL, follower_callback, &data);
+	assert(data.query && follower);
+
+	netresolve_epoll_wait(context);
+	assert(data.follower_finished == 1);
+	assert(data.leader_finished == 0);
+
+	netresolve_query_free(follower);
+	netresolve_context_free(context);
+}
+
+/* SRV requests with the default protocol match the cached response. */
+static void
+test_srv(struct test_backend_stats *stats)
+{
+	netresolve_t context = netresolve_context_new();
+	netresolve_query_t query;
+	int runs = stats->runs;
+
+	netresolve_set_backend_string(context, "test 192.0.2.3");
+	netresolve_context_set_options(context,
+			NETRESOLVE_OPTION_DNS_SRV_LOOKUP, true,
+			NETRESOLVE_OPTION_DONE);
+
+	for (int i = 0; i < 2; i++) {
+		query = netresolve_query_forward(context, "srv.test", "http", NULL, NULL);
+		assert(netresolve_query_get_count(query));
+		netresolve_query_free(query);
+	}
+	assert(stats->runs == runs + 1);
+
+	netresolve_context_free(context);
+}
+
+int
+main(int argc, char **argv)
+{
+	struct test_backend_stats *stats = test_backend_get_stats();
+
+	test_ttl(stats);
+	test_dns(stats);
+	test_reverse(stats);
+	test_concurrent(stats);
+	test_free_leader("test 192.0.2.4@20", "leader.test");
+	test_free_leader("test fail@20", "failed-leader.test");
+	test_srv(stats);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,294 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <netresolve.h>
+#include <netresolve-epoll.h>
+#include <netresolve-socket.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct result {
+	char address[INET6_ADDRSTRLEN];
+	char next[INET6_ADDRSTRLEN];
+	bool retry;
+};
+
+static long
+get_time_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Listen on the given address and port, zero choosing a free one. */
+static int
+make_listener(const char *address, int *port, int backlog)
+{
+	struct sockaddr_storage sa = { 0 };
+	socklen_t salen;
+	int one = 1;
+	int fd;
+
+	if (strchr(address, ':')) {
+		struct sockaddr_in6 *sa6 = (void *) &sa;
+
+		sa6->sin6_family = AF_INET6;
+		sa6->sin6_port = htons(*port);
+		assert(inet_pton(AF_INET6, address, &sa6->sin6_addr) == 1);
+		salen = sizeof *sa6;
+	} else {
+		struct sockaddr_in *sa4 = (void *) &sa;
+
+		sa4->sin_family = AF_INET;
+		sa4->sin_port = htons(*port);
+		assert(inet_pton(AF_INET, address, &sa4->sin_addr) == 1);
+		salen = sizeof *sa4;
+	}
+
+	assert((fd = socket(sa.ss_family, SOCK_STREAM, 0)) != -1);
+	assert(!setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one));
+	if (sa.ss_family == AF_INET6)
+		assert(!setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof one));
+	assert(!bind(fd, (struct sockaddr *) &sa, salen));
+	assert(!listen(fd, backlog));
+
+	if (!*port) {
+		assert(!getsockname(fd, (struct sockaddr *) &sa, &salen));
+		*port = ntohs(((struct sockaddr_in *) &sa)->sin_port);
+	}
+
+	return fd;
+}
+
+/* Listen with a full accept queue so that new connections hang. */
+static int
+make_hanging_listener(const char *address, int port, int *filler)
+{
+	struct sockaddr_in sa = { .sin_family = AF_INET, .sin_port = htons(port) };
+	int fd = make_listener(address, &port, 0);
+
+	assert(inet_pton(AF_INET, address, &sa.sin_addr) == 1);
+	assert((*filler = socket(AF_INET, SOCK_STREAM, 0)) != -1);
+	assert(!connect(*filler, (struct sockaddr *) &sa, sizeof sa));
+
+	return fd;
+}
+
+static void
+on_connect(netresolve_query_t query, int idx, int fd, void *user_data)
+{
+	struct result *result = user_data;
+	char *buffer = *result->address ? result->next : result->address;
+	const void *address;
+	int family;
+
+	netresolve_query_get_node_info(query, idx, &family, &address, NULL);
+	assert(inet_ntop(family, address, buffer, INET6_ADDRSTRLEN));
+	assert(!close(fd));
+
+	if (result->retry && buffer == result->address)
+		netresolve_connect_next(query);
+}
+
+static void
+run_connect(netresolve_t context, const char *backends, int family, int port, struct result *result)
+{
+	netresolve_query_t query;
+	char service[16];
+
+	snprintf(service, sizeof service, "%d", port);
+	netresolve_set_backend_string(context, backends);
+
+	query = netresolve_connect(context, "connect.test", service, family, SOCK_STREAM, 0, on_connect, result);
+	assert(query);
+	assert(*result->address);
+	netresolve_connect_free(query);
+}
+
+/* IPv6 is tried first even when the IPv4 address comes first, and an IPv6
+ * address arriving within the resolution delay is still preferred.
+ */
+static void
+test_ipv6_first(void)
+{
+	netresolve_t context = netresolve_context_new();
+	struct result result = { .retry = true };
+	int port = 0;
+	int fd6 = make_listener("::1", &port, SOMAXCONN);
+	int fd4 = make_listener("127.0.0.1", &port, SOMAXCONN);
+
+	run_connect(context, "test 127.0.0.1 ::1", AF_UNSPEC, port, &result);
+	assert(!strcmp(result.address, "::1"));
+	assert(!strcmp(result.next, "127.0.0.1"));
+
+	result = (struct result) { 0 };
+	run_connect(context, "test 127.0.0.1 ::1@10", AF_UNSPEC, port, &result);
+	assert(!strcmp(result.address, "::1"));
+
+	result = (struct result) { 0 };
+	run_connect(context, "test 127.0.0.1 ::1@500", AF_UNSPEC, port, &result);
+	assert(!strcmp(result.address, "127.0.0.1"));
+
+	netresolve_context_free(context);
+	close(fd4);
+	close(fd6);
+}
+
+/* Another address is tried when the first one doesn't answer within the
+ * attempt delay. With a connection window of one, it's only tried when
+ * the first attempt times out.
+ */
+static void
+test_attempt_delay(int window, const char *hanging, const char *listening, long min, long max)
+{
+	netresolve_t context = netresolve_context_new();
+	struct result result = { 0 };
+	char backends[64];
+	int port = 0;
+	int fd = make_listener(listening, &port, SOMAXCONN);
+	int filler;
+	int hang = make_hanging_listener(hanging, port, &filler);
+	long elapsed;
+
+	netresolve_context_set_options(context, NETRESOLVE_OPTION_CONNECT_WINDOW, window, NETRESOLVE_OPTION_DONE);
+	snprintf(backends, sizeof backends, "test %s %s", hanging, listening);
+
+	elapsed = get_time_ms();
+	run_connect(context, backends, AF_INET, port, &result);
+	elapsed = get_time_ms() - elapsed;
+
+	assert(!strcmp(result.address, listening));
+	assert(elapsed >= min && elapsed < max);
+
+	netresolve_context_free(context);
+	close(filler);
+	close(hang);
+	close(fd);
+}
+
+/* An address that refused a connection is tried after one that accepted
+ * it, even after it starts accepting connections itself.
+ */
+static void
+test_history(void)
+{
+	netresolve_t context = netresolve_context_new();
+	struct result result = { 0 };
+	int port = 0;
+	int fd = make_listener("127.0.0.7", &port, SOMAXCONN);
+	int fd2;
+
+	run_connect(context, "test 127.0.0.6 127.0.0.7", AF_INET, port, &result);
+	assert(!strcmp(result.address, "127.0.0.7"));
+
+	fd2 = make_listener("127.0.0.6", &port, SOMAXCONN);
+
+	result = (struct result) { 0 };
+	run_connect(context, "test 127.0.0.6 127.0.0.7", AF_INET, port, &result);
+	assert(!strcmp(result.address, "127.0.0.7"));
+
+	netresolve_context_free(context);
+	close(fd2);
+	close(fd);
+}
+
+static void
+check_first(netresolve_query_t query, void *user_data)
+{
+	char buffer[INET6_ADDRSTRLEN];
+	const void *address;
+	int family;
+	int *checked = user_data;
+
+	assert(netresolve_query_get_count(query) == 2);
+	netresolve_query_get_node_info(query, 0, &family, &address, NULL);
+	assert(inet_ntop(family, address, buffer, sizeof buffer));
+	assert(!strcmp(buffer, "::1"));
+	(*checked)++;
+}
+
+/* Connections keep the addresses in the order they arrived, other queries
+ * sharing their results still get them sorted, both from the cache and
+ * when attached to the connection's query in progress.
+ */
+static void
+test_shared_order(bool nonblocking)
+{
+	netresolve_t context = netresolve_context_new();
+	struct result result = { 0 };
+	netresolve_query_t connect, query;
+	char service[16];
+	int checked = 0;
+	int port = 0;
+	int fd6 = make_listener("::1", &port, SOMAXCONN);
+	int fd4 = make_listener("127.0.0.1", &port, SOMAXCONN);
+
+	snprintf(service, sizeof service, "%d", port);
+	if (nonblocking)
+		netresolve_epoll_fd(context);
+	netresolve_set_backend_string(context, "test 127.0.0.1 ::1@10");
+	netresolve_context_set_options(context,
+			NETRESOLVE_OPTION_SOCKTYPE, SOCK_STREAM,
+			NETRESOLVE_OPTION_DEFAULT_LOOPBACK, true,
+			NETRESOLVE_OPTION_DONE);
+
+	connect = netresolve_connect(context, "order.test", service, AF_UNSPEC, SOCK_STREAM, 0, on_connect, &result);
+	assert(connect);
+	query = netresolve_query_forward(context, "order.test", service, check_first, &checked);
+	assert(query);
+	if (nonblocking)
+		netresolve_epoll_wait(context);
+	assert(*result.address);
+	assert(checked == 1);
+
+	netresolve_query_free(query);
+	netresolve_connect_free(connect);
+	netresolve_context_free(context);
+	close(fd4);
+	close(fd6);
+}
+
+int
+main(int argc, char **argv)
+{
+	setenv("NETRESOLVE_RESOLUTION_DELAY", "50", true);
+	setenv("NETRESOLVE_CONNECT_ATTEMPT_DELAY", "100", true);
+	setenv("NETRESOLVE_CONNECT_TIMEOUT", "1", true);
+
+	test_ipv6_first();
+	test_attempt_delay(0, "127.0.0.2", "127.0.0.3", 90, 900);
+	test_attempt_delay(1, "127.0.0.4", "127.0.0.5", 900, 3000);
+	test_history();
+	test_shared_order(false);
+	test_shared_order(true);
+
+	return EXIT_SUCCESS;
+}
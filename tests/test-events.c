@@ -0,0 +1,122 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <netresolve.h>
+#include <netresolve-epoll.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static long
+get_time_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void
+check_address(netresolve_query_t query, size_t idx, const char *expected)
+{
+	char buffer[INET6_ADDRSTRLEN];
+	const void *address;
+	int family;
+
+	netresolve_query_get_node_info(query, idx, &family, &address, NULL);
+	assert(inet_ntop(family, address, buffer, sizeof buffer));
+	assert(!strcmp(buffer, expected));
+}
+
+static void
+callback(netresolve_query_t query, void *user_data)
+{
+	int *finished = user_data;
+
+	assert(netresolve_query_get_count(query) == 1);
+	(*finished)++;
+
+	/* The query may be freed from its own callback. */
+	netresolve_query_free(query);
+}
+
+/* Timeouts fire in the order of their deadlines, not in the order they
+ * were added. Unsorted results keep the order the paths were added in.
+ */
+static void
+test_timer_order(void)
+{
+	netresolve_t context = netresolve_context_new();
+	netresolve_query_t query;
+	long start = get_time_ms();
+
+	netresolve_set_backend_string(context, "test 192.0.2.3@30 192.0.2.1@10 192.0.2.2@20 192.0.2.4@25 192.0.2.0");
+
+	query = netresolve_query_forward(context, "timers.test", NULL, NULL, NULL);
+	assert(netresolve_query_get_count(query) == 5);
+	check_address(query, 0, "192.0.2.0");
+	check_address(query, 1, "192.0.2.1");
+	check_address(query, 2, "192.0.2.2");
+	check_address(query, 3, "192.0.2.4");
+	check_address(query, 4, "192.0.2.3");
+	assert(get_time_ms() - start >= 30);
+
+	netresolve_query_free(query);
+	netresolve_context_free(context);
+}
+
+/* Answers available right away are passed to the callback from the event
+ * loop, not from within the call that starts the query.
+ */
+static void
+test_deferred(const char *backends, const char *node)
+{
+	netresolve_t context = netresolve_context_new();
+	int finished = 0;
+
+	netresolve_epoll_fd(context);
+	netresolve_set_backend_string(context, backends);
+
+	assert(netresolve_query_forward(context, node, NULL, callback, &finished));
+	assert(finished == 0);
+
+	netresolve_epoll_wait(context);
+	assert(finished == 1);
+
+	netresolve_context_free(context);
+}
+
+int
+main(int argc, char **argv)
+{
+	setenv("NETRESOLVE_SORT_RESULTS", "no", true);
+
+	test_timer_order();
+	test_deferred("test 192.0.2.5", "deferred.test");
+	test_deferred("numerichost", "192.0.2.6");
+
+	return EXIT_SUCCESS;
+}
@@ -94,3 +94,17 @@ $DIFF <($NR --node x-x-x-x-x-x-x-x-x) $DATA/failed
 $DIFF <($NR --node /path/to/socket --family unix) $DATA/unix
 $DIFF <($NR --node /path/to/socket --family unix --socktype stream) $DATA/unix-stream
 $DIFF <($NR --node /path/to/socket --family unix --socktype dgram) $DATA/unix-dgram
+
+# fast path answers must match the backend answers
+BACKEND="env NETRESOLVE_SYSCONFDIR=/nonexistent $NR --backends hosts"
+$DIFF <($NR) <($BACKEND\|any)
+$DIFF <($NR --service http) <($BACKEND\|any --service http)
+$DIFF <($NR --node 1.2.3.4) <($BACKEND\|numerichost --node 1.2.3.4)
+$DIFF <($NR --node 1.2.3.4%lo) <($BACKEND\|numerichost --node 1.2.3.4%lo)
+$DIFF <($NR --node 1:2:3:4:5:6:7:8%lo) <($BACKEND\|numerichost --node 1:2:3:4:5:6:7:8%lo)
+$DIFF <($NR --node localhost) <($BACKEND\|loopback --node localhost)
+$DIFF <($NR --node localhost4) <($BACKEND\|loopback --node localhost4)
+$DIFF <($NR --node localhost6) <($BACKEND\|loopback --node localhost6)
+$DIFF <($NR --node localhost --service http) <($BACKEND\|loopback --node localhost --service http)
+$DIFF <($NR --node /path/to/socket --family unix) <($BACKEND\|unix --node /path/to/socket --family unix)
+$DIFF <($NR --node /path/to/socket --family unix --socktype stream) <($BACKEND\|unix --node /path/to/socket --family unix --socktype stream)
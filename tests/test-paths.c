@@ -0,0 +1,152 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <netresolve.h>
+#include <netresolve-epoll.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <string.h>
+#include <time.h>
+
+#include "backend-test.h"
+
+static const char *addresses[] = { "127.0.0.1", "127.0.0.2", "127.0.0.3" };
+
+struct paths {
+	size_t reported;
+	size_t free_at;
+	int finished;
+};
+
+static long
+get_time_ms(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void
+check_address(netresolve_query_t query, size_t idx, const char *expected)
+{
+	char buffer[INET6_ADDRSTRLEN];
+	const void *address;
+	int family;
+
+	netresolve_query_get_node_info(query, idx, &family, &address, NULL);
+	assert(inet_ntop(family, address, buffer, sizeof buffer));
+	assert(!strcmp(buffer, expected));
+}
+
+static void
+path_callback(netresolve_query_t query, size_t idx, void *user_data)
+{
+	struct paths *paths = user_data;
+
+	assert(idx == paths->reported++);
+	assert(!paths->finished);
+	check_address(query, idx, addresses[idx]);
+
+	if (paths->reported == paths->free_at)
+		netresolve_query_free(query);
+}
+
+static void
+callback(netresolve_query_t query, void *user_data)
+{
+	struct paths *paths = user_data;
+
+	assert(paths->reported == 3);
+	assert(netresolve_query_get_count(query) == 3);
+	paths->finished++;
+
+	netresolve_query_free(query);
+}
+
+/* Paths are reported one by one with consecutive indexes from the event
+ * loop, even those available right away. A query freed from the path
+ * callback isn't reported any further.
+ */
+static void
+test_path_callback(size_t free_at)
+{
+	netresolve_t context = netresolve_context_new();
+	struct paths paths = { .free_at = free_at };
+
+	netresolve_epoll_fd(context);
+	netresolve_set_backend_string(context, "test 127.0.0.1 127.0.0.2@10 127.0.0.3@20");
+	netresolve_context_set_options(context,
+			NETRESOLVE_OPTION_PATH_CALLBACK, path_callback, &paths,
+			NETRESOLVE_OPTION_DONE);
+
+	assert(netresolve_query_forward(context, "paths.test", NULL, callback, &paths));
+	assert(paths.reported == 0);
+
+	netresolve_epoll_wait(context);
+	if (free_at) {
+		assert(paths.reported == free_at);
+		assert(paths.finished == 0);
+	} else
+		assert(paths.finished == 1);
+
+	netresolve_context_free(context);
+}
+
+/* Queries are finished as soon as they have enough paths, cancelling the
+ * backend still waiting for the rest.
+ */
+static void
+test_max_paths(struct test_backend_stats *stats)
+{
+	netresolve_t context = netresolve_context_new();
+	netresolve_query_t query;
+	int cancelled = stats->cancelled;
+	long start = get_time_ms();
+
+	netresolve_set_backend_string(context, "test 127.0.0.1 127.0.0.2@50 127.0.0.3@5000");
+	netresolve_context_set_options(context, NETRESOLVE_OPTION_MAX_PATHS, 2, NETRESOLVE_OPTION_DONE);
+
+	query = netresolve_query_forward(context, "max-paths.test", NULL, NULL, NULL);
+	assert(query);
+	assert(netresolve_query_get_count(query) == 2);
+	assert(get_time_ms() - start < 1000);
+	assert(stats->cancelled == cancelled + 1);
+
+	netresolve_query_free(query);
+	netresolve_context_free(context);
+}
+
+int
+main(int argc, char **argv)
+{
+	setenv("NETRESOLVE_SORT_RESULTS", "no", true);
+
+	test_path_callback(0);
+	test_path_callback(1);
+	test_path_callback(2);
+	test_max_paths(test_backend_get_stats());
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,257 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <netresolve.h>
+#include <netresolve-epoll.h>
+#include <netresolve-socket.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define COUNT 16
+
+static int
+make_listener(int *port)
+{
+	struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	socklen_t salen = sizeof sa;
+	int fd;
+
+	assert((fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) != -1);
+	assert(!bind(fd, (struct sockaddr *) &sa, salen));
+	assert(!listen(fd, SOMAXCONN));
+	assert(!getsockname(fd, (struct sockaddr *) &sa, &salen));
+	*port = ntohs(sa.sin_port);
+
+	return fd;
+}
+
+static int
+accept_one(int listener)
+{
+	int fd = accept(listener, NULL, NULL);
+
+	assert(fd != -1 || errno == EAGAIN || errno == EWOULDBLOCK);
+
+	return fd;
+}
+
+static bool
+is_open(int fd)
+{
+	return fcntl(fd, F_GETFD) != -1;
+}
+
+static void
+on_pooled(netresolve_connect_pool_t pool, int fd, void *user_data)
+{
+	int *result = user_data;
+
+	*result = fd;
+}
+
+static int
+get_pooled(netresolve_connect_pool_t pool, const char *service)
+{
+	int fd = -2;
+
+	netresolve_connect_pooled(pool, "127.0.0.1", service, AF_INET, SOCK_STREAM, 0, on_pooled, &fd);
+	assert(fd >= 0);
+
+	return fd;
+}
+
+/* Released sockets are handed out again while they're alive. Dead ones
+ * are replaced by new connections and sockets the pool didn't hand out
+ * are refused.
+ */
+static void
+test_connect_pool(void)
+{
+	netresolve_t context = netresolve_context_new();
+	netresolve_connect_pool_t pool = netresolve_connect_pool_new(context, 0, 2);
+	char service[16];
+	int port;
+	int listener = make_listener(&port);
+	int fd, peer, other;
+
+	assert(pool);
+	snprintf(service, sizeof service, "%d", port);
+
+	fd = get_pooled(pool, service);
+	assert((peer = accept_one(listener)) != -1);
+	assert(netresolve_connect_release(pool, fd, true));
+	assert(is_open(fd));
+
+	/* Reused without a new connection. */
+	assert(get_pooled(pool, service) == fd);
+	assert(accept_one(listener) == -1);
+
+	/* Only sockets currently handed out can be released. */
+	assert(netresolve_connect_release(pool, fd, true));
+	assert(!netresolve_connect_release(pool, fd, true));
+	assert(!netresolve_connect_release(pool, -1, true));
+	assert((other = socket(AF_INET, SOCK_STREAM, 0)) != -1);
+	assert(!netresolve_connect_release(pool, other, false));
+	assert(is_open(other));
+	close(other);
+
+	/* The peer closed the idle connection. */
+	close(peer);
+	fd = get_pooled(pool, service);
+	assert((peer = accept_one(listener)) != -1);
+
+	/* Released without reuse. */
+	assert(netresolve_connect_release(pool, fd, false));
+	assert(!is_open(fd));
+
+	netresolve_connect_pool_free(pool);
+	netresolve_context_free(context);
+	close(peer);
+	close(listener);
+}
+
+static void
+on_pooled_free(netresolve_connect_pool_t pool, int fd, void *user_data)
+{
+	int *result = user_data;
+
+	*result = fd;
+	netresolve_connect_pool_free(pool);
+}
+
+/* The pool can be freed from its callback, both when the connection is
+ * made right away and from the event loop, including when it fails.
+ */
+static void
+test_free_pool(bool nonblocking, bool refused)
+{
+	netresolve_t context = netresolve_context_new();
+	netresolve_connect_pool_t pool = netresolve_connect_pool_new(context, 1, 2);
+	char service[16];
+	int port;
+	int listener = make_listener(&port);
+	int fd = -2;
+
+	assert(pool);
+	snprintf(service, sizeof service, "%d", port);
+	if (refused)
+		close(listener);
+	if (nonblocking)
+		netresolve_epoll_fd(context);
+
+	netresolve_connect_pooled(pool, "127.0.0.1", service, AF_INET, SOCK_STREAM, 0, on_pooled_free, &fd);
+	if (nonblocking)
+		netresolve_epoll_wait(context);
+
+	if (refused)
+		assert(fd == -1);
+	else {
+		assert(fd >= 0);
+		close(fd);
+		close(listener);
+	}
+
+	netresolve_context_free(context);
+}
+
+struct listener {
+	netresolve_query_t query;
+	int count;
+	int *total;
+	struct listener *other;
+};
+
+static void
+on_accept(netresolve_query_t query, int idx, int fd, void *user_data)
+{
+	struct listener *listener = user_data;
+
+	listener->count++;
+	close(fd);
+
+	if (++*listener->total == COUNT) {
+		netresolve_listen_free(listener->other->query);
+		netresolve_listen_free(listener->query);
+	}
+}
+
+/* Two listeners share a port and together accept all connections. */
+static void
+test_reuse_port(void)
+{
+	netresolve_t context = netresolve_context_new();
+	struct sockaddr_in sa = { .sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+	struct listener listeners[2];
+	int clients[COUNT];
+	char service[16];
+	int total = 0;
+	int port;
+
+	close(make_listener(&port));
+	snprintf(service, sizeof service, "%d", port);
+	sa.sin_port = htons(port);
+
+	netresolve_epoll_fd(context);
+	netresolve_context_set_options(context, NETRESOLVE_OPTION_REUSE_PORT, true, NETRESOLVE_OPTION_DONE);
+
+	for (int i = 0; i < 2; i++) {
+		listeners[i] = (struct listener) { .total = &total, .other = &listeners[!i] };
+		assert((listeners[i].query = netresolve_listen(context, "127.0.0.1", service, AF_INET, SOCK_STREAM, 0)));
+	}
+	netresolve_epoll_wait(context);
+
+	for (int i = 0; i < COUNT; i++) {
+		assert((clients[i] = socket(AF_INET, SOCK_STREAM, 0)) != -1);
+		assert(!connect(clients[i], (struct sockaddr *) &sa, sizeof sa));
+	}
+
+	for (int i = 0; i < 2; i++)
+		netresolve_accept(listeners[i].query, on_accept, &listeners[i]);
+	netresolve_epoll_wait(context);
+
+	assert(total == COUNT);
+	assert(listeners[0].count > 0 && listeners[1].count > 0);
+
+	for (int i = 0; i < COUNT; i++)
+		close(clients[i]);
+	netresolve_context_free(context);
+}
+
+int
+main(int argc, char **argv)
+{
+	test_connect_pool();
+	test_free_pool(false, false);
+	test_free_pool(false, true);
+	test_free_pool(true, false);
+	test_free_pool(true, true);
+	test_reuse_port();
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,123 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <netresolve.h>
+#include <arpa/inet.h>
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "backend-test.h"
+
+#define COUNT 1000
+
+/* Two targets with priority 10 and two with priority 20, the latter
+ * weighted 75 to 25.
+ */
+#define BACKENDS "test 127.0.0.1/20/75 127.0.0.2/10/50 127.0.0.3/20/25 127.0.0.4/10/50"
+
+/* Check the priorities and return whether the heavier priority 20 target
+ * comes first in its group.
+ */
+static bool
+check_order(netresolve_query_t query)
+{
+	static const int priorities[] = { 10, 10, 20, 20 };
+	char buffer[INET_ADDRSTRLEN];
+	const void *address;
+	int family;
+
+	assert(netresolve_query_get_count(query) == 4);
+	for (int i = 0; i < 4; i++) {
+		int priority;
+
+		netresolve_query_get_aux_info(query, i, &priority, NULL, NULL);
+		assert(priority == priorities[i]);
+	}
+
+	netresolve_query_get_node_info(query, 2, &family, &address, NULL);
+	assert(inet_ntop(family, address, buffer, sizeof buffer));
+
+	return !strcmp(buffer, "127.0.0.1");
+}
+
+/* Targets are ordered by priority and picked by weight within a priority
+ * group.
+ */
+static void
+test_weights(void)
+{
+	netresolve_t context = netresolve_context_new();
+	int heavier = 0;
+	char name[64];
+
+	netresolve_set_backend_string(context, BACKENDS);
+
+	for (int i = 0; i < COUNT; i++) {
+		netresolve_query_t query;
+
+		snprintf(name, sizeof name, "srv%d.test", i);
+		query = netresolve_query_forward(context, name, NULL, NULL, NULL);
+		assert(query);
+		heavier += check_order(query);
+		netresolve_query_free(query);
+	}
+
+	/* Expected 750 with a standard deviation below 14. */
+	assert(heavier > 650 && heavier < 850);
+
+	netresolve_context_free(context);
+}
+
+/* Cache hits are reordered as well. */
+static void
+test_cache(struct test_backend_stats *stats)
+{
+	netresolve_t context = netresolve_context_new();
+	int runs = stats->runs;
+	int heavier = 0;
+
+	netresolve_set_backend_string(context, BACKENDS);
+
+	for (int i = 0; i < 100; i++) {
+		netresolve_query_t query = netresolve_query_forward(context, "cached.test", NULL, NULL, NULL);
+
+		assert(query);
+		heavier += check_order(query);
+		netresolve_query_free(query);
+	}
+
+	assert(stats->runs == runs + 1);
+	assert(heavier > 0 && heavier < 100);
+
+	netresolve_context_free(context);
+}
+
+int
+main(int argc, char **argv)
+{
+	test_weights();
+	test_cache(test_backend_get_stats());
+
+	return EXIT_SUCCESS;
+}
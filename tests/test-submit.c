@@ -0,0 +1,223 @@
+/* Copyright (c) 2013+ Pavel Šimerda, Red Hat, Inc. (psimerda at redhat.com) and others
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice, this
+ *    list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+ * ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <netresolve.h>
+#include <netresolve-epoll.h>
+#include <netresolve-pool.h>
+#include <netresolve-submit.h>
+#include <assert.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "backend-test.h"
+
+#define COUNT 8
+
+struct pool_data {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t main;
+	int finished;
+};
+
+static void
+pool_callback(netresolve_query_t query, void *user_data)
+{
+	struct pool_data *data = user_data;
+
+	/* Pool callbacks are called in the worker threads. */
+	assert(!pthread_equal(pthread_self(), data->main));
+	assert(netresolve_query_get_count(query) == 1);
+
+	pthread_mutex_lock(&data->mutex);
+	data->finished++;
+	pthread_cond_signal(&data->cond);
+	pthread_mutex_unlock(&data->mutex);
+}
+
+static void
+wait_pool(struct pool_data *data, int count)
+{
+	pthread_mutex_lock(&data->mutex);
+	while (data->finished < count)
+		pthread_cond_wait(&data->cond, &data->mutex);
+	pthread_mutex_unlock(&data->mutex);
+}
+
+/* Queries submitted to the pool are finished in the worker threads and
+ * identical ones are resolved only once.
+ */
+static void
+test_pool(struct test_backend_stats *stats)
+{
+	struct pool_data data = {
+		.mutex = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.main = pthread_self(),
+	};
+	netresolve_pool_t pool = netresolve_pool_new(4);
+	char name[64];
+	int runs;
+
+	assert(pool);
+
+	runs = __atomic_load_n(&stats->runs, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < COUNT; i++) {
+		snprintf(name, sizeof name, "pool%d.test", i);
+		assert(netresolve_pool_query_forward(pool, name, NULL, pool_callback, &data));
+	}
+	wait_pool(&data, COUNT);
+	assert(__atomic_load_n(&stats->runs, __ATOMIC_SEQ_CST) == runs + COUNT);
+
+	runs = __atomic_load_n(&stats->runs, __ATOMIC_SEQ_CST);
+	for (int i = 0; i < COUNT; i++)
+		assert(netresolve_pool_query_forward(pool, "shared.test", NULL, pool_callback, &data));
+	wait_pool(&data, 2 * COUNT);
+	assert(__atomic_load_n(&stats->runs, __ATOMIC_SEQ_CST) == runs + 1);
+
+	netresolve_pool_free(pool);
+}
+
+struct loop_data {
+	netresolve_t context;
+	bool stop;
+};
+
+static void *
+run_loop(void *user_data)
+{
+	struct loop_data *data = user_data;
+	struct pollfd pfd = { .fd = netresolve_epoll_fd(data->context), .events = POLLIN };
+
+	while (!__atomic_load_n(&data->stop, __ATOMIC_ACQUIRE))
+		if (poll(&pfd, 1, 10) > 0)
+			netresolve_epoll_dispatch(data->context);
+
+	return NULL;
+}
+
+/* Queries submitted from the main thread are resolved by a context running
+ * in another thread and collected from the completion queue.
+ */
+static void
+test_submit(void)
+{
+	struct loop_data data = { .context = netresolve_epoll_new() };
+	netresolve_completion_t completion = netresolve_completion_new();
+	struct pollfd pfd = { .events = POLLIN };
+	bool seen[COUNT] = { false };
+	pthread_t thread;
+	int finished = 0;
+	char name[64];
+
+	assert(data.context && completion);
+	assert(netresolve_submit_setup(data.context));
+	assert(!pthread_create(&thread, NULL, run_loop, &data));
+
+	for (int i = 0; i < COUNT; i++) {
+		snprintf(name, sizeof name, "submit%d.test", i);
+		assert(netresolve_submit_forward(data.context, name, NULL, completion, &seen[i]));
+	}
+
+	pfd.fd = netresolve_completion_fd(completion);
+	while (finished < COUNT) {
+		netresolve_query_t query;
+		void *user_data;
+
+		assert(poll(&pfd, 1, 5000) == 1);
+
+		while ((query = netresolve_completion_next(completion, &user_data))) {
+			bool *flag = user_data;
+
+			assert(!*flag);
+			*flag = true;
+			finished++;
+
+			assert(netresolve_query_get_count(query) == 1);
+			netresolve_submit_free(data.context, query);
+		}
+	}
+
+	__atomic_store_n(&data.stop, true, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+
+	netresolve_context_free(data.context);
+	netresolve_completion_free(completion);
+}
+
+static void
+batch_done(netresolve_query_t *queries, size_t count, void *user_data)
+{
+	int *done = user_data;
+
+	(*done)++;
+}
+
+/* A batch never runs more queries at a time than requested. */
+static void
+test_batch(struct test_backend_stats *stats, size_t concurrency, int expected)
+{
+	netresolve_t context = netresolve_context_new();
+	struct netresolve_batch_request requests[COUNT];
+	netresolve_query_t queries[COUNT];
+	char names[COUNT][64];
+	int runs = stats->runs;
+	int done = 0;
+
+	assert(context);
+
+	memset(requests, 0, sizeof requests);
+	for (int i = 0; i < COUNT; i++) {
+		snprintf(names[i], sizeof names[i], "batch%zu-%d.test", concurrency, i);
+		requests[i].node = names[i];
+	}
+
+	stats->max_active = 0;
+	assert(netresolve_query_batch(context, requests, COUNT, concurrency, queries, NULL, batch_done, &done));
+	assert(done == 1);
+	assert(stats->runs == runs + COUNT);
+	assert(stats->max_active == expected);
+
+	for (int i = 0; i < COUNT; i++) {
+		assert(queries[i]);
+		assert(netresolve_query_get_count(queries[i]) == 1);
+		netresolve_query_free(queries[i]);
+	}
+
+	netresolve_context_free(context);
+}
+
+int
+main(int argc, char **argv)
+{
+	setenv("NETRESOLVE_BACKENDS", "test 192.0.2.1@20", true);
+
+	test_pool(test_backend_get_stats());
+	test_submit();
+	test_batch(test_backend_get_stats(), 2, 2);
+	test_batch(test_backend_get_stats(), 0, COUNT);
+
+	return EXIT_SUCCESS;
+}